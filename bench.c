@@ -0,0 +1,317 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+
+// Drives xswm on a virtual display with synthetic client-storms, see make
+// bench. Every workload is run once step by step, waiting for the effect of
+// each operation to measure its latency, and once as a burst to measure the
+// throughput. A burst ends with the stats-command, since xswm handles events
+// in order its answer arrives once everything before was handled.
+
+// Opcodes of commands[] in main.c, which is only ever appended to
+enum { OpcodeStats = 3, OpcodeNext = 5 };
+
+static const int TIMEOUT = 2000; // Milliseconds to wait for an event
+
+// Atoms
+enum { ActiveWindow, ClientList, Cmd, Stats, SupportingWMCheck, Atom_N };
+static Atom atoms[Atom_N];
+
+// Misc
+static Display *d;
+static Window r;
+static int sw, sh;
+static Window *windows;
+static int windows_n;
+static unsigned long *latencies;
+
+static unsigned long now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long) t.tv_sec * 1000000
+        + (unsigned long) t.tv_nsec / 1000;
+}
+
+static int compare(const void *a, const void *b) {
+    const unsigned long x = *(const unsigned long *) a;
+    const unsigned long y = *(const unsigned long *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Wait up to TIMEOUT for the next event
+static Bool next_event(XEvent *e) {
+    while (!XPending(d)) {
+        struct pollfd fd = {ConnectionNumber(d), POLLIN, 0};
+        if (poll(&fd, 1, TIMEOUT) <= 0)
+            return False;
+    }
+    XNextEvent(d, e);
+    return True;
+}
+
+static Bool wait_property(const Atom atom) {
+    XEvent e;
+    while (next_event(&e))
+        if (e.type == PropertyNotify && e.xproperty.window == r
+                && e.xproperty.atom == atom)
+            return True;
+    return False;
+}
+
+static Bool wait_map(const Window w) {
+    XEvent e;
+    while (next_event(&e))
+        if (e.type == MapNotify && e.xmap.window == w)
+            return True;
+    return False;
+}
+
+static Bool wait_configure(const Window w, const int width) {
+    XEvent e;
+    while (next_event(&e))
+        if (e.type == ConfigureNotify && e.xconfigure.window == w
+                && e.xconfigure.width == width)
+            return True;
+    return False;
+}
+
+// Wait until _NET_CLIENT_LIST holds n windows
+static Bool wait_clients(const unsigned long n) {
+    for (;;) {
+        Atom type;
+        int format;
+        unsigned long items_n, after;
+        unsigned char *value = NULL;
+        XGetWindowProperty(d, r, atoms[ClientList], 0, 0, False, XA_WINDOW,
+            &type, &format, &items_n, &after, &value);
+        XFree(value);
+        if (after / 4 == n)
+            return True;
+        if (!wait_property(atoms[ClientList]))
+            return False;
+    }
+}
+
+static void send_root(const Atom type, const Window w, const long l0) {
+    XSendEvent(d, r, False, SubstructureRedirectMask | SubstructureNotifyMask,
+        (XEvent *) &(XClientMessageEvent) {
+            .type = ClientMessage,
+            .window = w,
+            .message_type = type,
+            .format = 32,
+            .data.l[0] = l0,
+        });
+}
+
+// Resizes the screen as far as xswm is concerned
+static void resize_root(const int width, const int height) {
+    XSendEvent(d, r, False, StructureNotifyMask,
+        (XEvent *) &(XConfigureEvent) {
+            .type = ConfigureNotify,
+            .event = r,
+            .window = r,
+            .width = width,
+            .height = height,
+        });
+}
+
+static void set_fixed(const Window w, const Bool fixed) {
+    XSizeHints hints = {
+        .flags = fixed ? PMinSize | PMaxSize : 0,
+        .min_width = 200, .min_height = 200,
+        .max_width = 200, .max_height = 200,
+    };
+    XSetWMNormalHints(d, w, &hints);
+}
+
+// Wait until xswm handled everything sent before and drop what is left over
+static Bool drain(void) {
+    send_root(atoms[Cmd], r, OpcodeStats);
+    XFlush(d);
+    const Bool done = wait_property(atoms[Stats]);
+    XSync(d, True);
+    return done;
+}
+
+static void report(const char *name, const int n, const unsigned long burst) {
+    qsort(latencies, (size_t) n, sizeof(*latencies), compare);
+    printf("%-10s n=%-5d p50=%luus p99=%luus max=%luus %.0f events/s\n",
+        name, n, latencies[n / 2], latencies[n * 99 / 100], latencies[n - 1],
+        burst ? (double) n * 1000000 / (double) burst : 0.0);
+}
+
+static Bool map_all(const Bool timed) {
+    for (int i = 0; i < windows_n; i++) {
+        const unsigned long start = now();
+        XMapWindow(d, windows[i]);
+        XFlush(d);
+        if (!wait_map(windows[i]))
+            return False;
+        if (timed)
+            latencies[i] = now() - start;
+    }
+    return True;
+}
+
+static Bool bench_map(void) {
+    if (!map_all(True))
+        return False;
+    report("map", windows_n, 0);
+    for (int i = 0; i < windows_n; i++) {
+        const unsigned long start = now();
+        XUnmapWindow(d, windows[i]);
+        XFlush(d);
+        if (!wait_clients((unsigned long) (windows_n - 1 - i)))
+            return False;
+        latencies[i] = now() - start;
+    }
+    report("unmap", windows_n, 0);
+    return map_all(False) && drain();
+}
+
+// Raise the windows round-robin, each one differs from the last one
+static Bool bench_raise(const int n) {
+    for (int i = 0; i < n; i++) {
+        const unsigned long start = now();
+        send_root(atoms[ActiveWindow], windows[i % windows_n], 2);
+        XFlush(d);
+        if (!wait_property(atoms[ActiveWindow]))
+            return False;
+        latencies[i] = now() - start;
+    }
+    const unsigned long start = now();
+    for (int i = 0; i < n; i++)
+        send_root(atoms[ActiveWindow], windows[i % windows_n], 2);
+    if (!drain())
+        return False;
+    report("raise", n, now() - start);
+    return True;
+}
+
+// Toggle the focused window between fixed-size, which keeps its requested
+// 200x200, and maximized
+static Bool bench_hints(const int n) {
+    const Window w = windows[(n - 1) % windows_n];
+    for (int i = 0; i < n; i++) {
+        const unsigned long start = now();
+        set_fixed(w, !(i % 2));
+        XFlush(d);
+        if (!wait_configure(w, i % 2 ? sw : 200))
+            return False;
+        latencies[i] = now() - start;
+    }
+    const unsigned long start = now();
+    for (int i = 0; i < n; i++)
+        set_fixed(w, !(i % 2));
+    set_fixed(w, False);
+    if (!drain())
+        return False;
+    report("hints", n, now() - start);
+    return True;
+}
+
+// Switch between two screen-sizes, the focused window follows
+static Bool bench_resize(const int n) {
+    const Window w = windows[(n - 1) % windows_n];
+    for (int i = 0; i < n; i++) {
+        const int width = i % 2 ? sw : sw / 2, height = i % 2 ? sh : sh / 2;
+        const unsigned long start = now();
+        resize_root(width, height);
+        XFlush(d);
+        if (!wait_configure(w, width))
+            return False;
+        latencies[i] = now() - start;
+    }
+    const unsigned long start = now();
+    for (int i = 0; i < n; i++)
+        resize_root(i % 2 ? sw : sw / 2, i % 2 ? sh : sh / 2);
+    resize_root(sw, sh);
+    if (!drain())
+        return False;
+    report("resize", n, now() - start);
+    return True;
+}
+
+// Step through the windows with the next-command
+static Bool bench_commands(const int n) {
+    for (int i = 0; i < n; i++) {
+        const unsigned long start = now();
+        send_root(atoms[Cmd], r, OpcodeNext);
+        XFlush(d);
+        if (!wait_property(atoms[ActiveWindow]))
+            return False;
+        latencies[i] = now() - start;
+    }
+    const unsigned long start = now();
+    for (int i = 0; i < n; i++)
+        send_root(atoms[Cmd], r, OpcodeNext);
+    if (!drain())
+        return False;
+    report("commands", n, now() - start);
+    return True;
+}
+
+// Wait up to five seconds for the display and xswm to come up
+static Bool wait_wm(void) {
+    const struct timespec interval = {0, 100000000};
+    for (int i = 0; i < 50; i++, nanosleep(&interval, NULL)) {
+        if (!d && !(d = XOpenDisplay(NULL)))
+            continue;
+        r = DefaultRootWindow(d);
+        atoms[SupportingWMCheck] =
+            XInternAtom(d, "_NET_SUPPORTING_WM_CHECK", False);
+        Atom type;
+        int format;
+        unsigned long items_n, after;
+        unsigned char *value = NULL;
+        XGetWindowProperty(d, r, atoms[SupportingWMCheck], 0, 1, False,
+            XA_WINDOW, &type, &format, &items_n, &after, &value);
+        XFree(value);
+        if (items_n)
+            return True;
+    }
+    return False;
+}
+
+int main(const int argc, const char *argv[]) {
+    windows_n = argc > 1 ? atoi(argv[1]) : 100;
+    const int n = argc > 2 ? atoi(argv[2]) : 1000;
+    if (windows_n < 2 || n < 2) {
+        fprintf(stderr, "Usage: xswm-bench [windows >= 2 [operations >= 2]]\n");
+        return EXIT_FAILURE;
+    }
+    if (!wait_wm()) {
+        fprintf(stderr, "Error: No xswm running on the display.\n");
+        return EXIT_FAILURE;
+    }
+    const int s = DefaultScreen(d);
+    sw = DisplayWidth(d, s), sh = DisplayHeight(d, s);
+    atoms[ActiveWindow] = XInternAtom(d, "_NET_ACTIVE_WINDOW", False);
+    atoms[ClientList] = XInternAtom(d, "_NET_CLIENT_LIST", False);
+    atoms[Cmd] = XInternAtom(d, "_XSWM_CMD", False);
+    atoms[Stats] = XInternAtom(d, "_XSWM_STATS", False);
+    XSelectInput(d, r, PropertyChangeMask);
+    windows = malloc((size_t) windows_n * sizeof(Window));
+    latencies = malloc((size_t) (n > windows_n ? n : windows_n)
+        * sizeof(unsigned long));
+    for (int i = 0; i < windows_n; i++) {
+        windows[i] = XCreateSimpleWindow(d, r, 0, 0, 200, 200, 0, 0, 0);
+        XSelectInput(d, windows[i], StructureNotifyMask);
+    }
+    const Bool done = bench_map() && bench_raise(n) && bench_hints(n)
+        && bench_resize(n) && bench_commands(n);
+    if (!done)
+        fprintf(stderr, "Error: Timed out waiting for xswm.\n");
+    for (int i = 0; i < windows_n; i++)
+        XDestroyWindow(d, windows[i]);
+    free(windows);
+    free(latencies);
+    XCloseDisplay(d);
+    return done ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,10 +1,41 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/sync.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+
+// Blocking calls are wrapped to be accounted to the running event-handler in
+// builds with -DAUDIT (make audit), see audit_begin(). Replies of xcb are
+// taken by audit_reply() there, which tells waits apart from pipelined ones.
+#ifdef AUDIT
+#define AUDIT_INT(call) (audit_begin(), audit_int(call))
+#define AUDIT_ATOM(call) (audit_begin(), audit_atom(call))
+#define AUDIT_REPLY(call, cookie) audit_reply((cookie).sequence)
+#else
+#define AUDIT_INT(call) (call)
+#define AUDIT_ATOM(call) (call)
+#define AUDIT_REPLY(call, cookie) (call)
+#endif
 
 // EWMH-Atoms
 enum {
@@ -24,12 +55,18 @@ enum {
     WMDesktop,
     WMFullPlacement,
     WMName,
+    WMState,
+    WMStateHidden,
     WMWindowType,
     WMWindowTypeDialog,
     WMWindowTypeNormal,
     WMWindowTypeSplash,
     WMWindowTypeUtility,
     Workarea,
+    WMBypassCompositor,
+    WMSyncRequest,
+    WMSyncRequestCounter,
+    WMPing,
     Net_N
 };
 
@@ -41,69 +78,446 @@ enum {
     WM_N
 };
 
+// Geometry of a window including its border-width
+typedef struct {
+    int x, y, width, height, border_width;
+} Geometry;
+
 typedef struct Client {
     const Window w;
-    Bool fixed, normal;
+    Bool fixed, transient;
+    Atom type; // First _NET_WM_WINDOW_TYPE or None
     int width_request, height_request;
     int border_width_request;
     int x, y, width, height;
-    struct Client *next;
+    Bool dirty; // Covered and not yet resized to the current screen
+    Bool hidden; // Covered and iconified, see update_visible()
+    unsigned long refocused; // Last time focus was taken back from it
+    Geometry server; // Last geometry configured on the server
+    Geometry event; // Last geometry sent in a synthetic ConfigureNotify
+    Bool extents; // Whether _NET_FRAME_EXTENTS was set
+    int protocols; // Protocol-flags of WM_PROTOCOLS
+    XSyncCounter counter; // _NET_WM_SYNC_REQUEST_COUNTER or None
+    XSyncAlarm alarm; // Triggers once counter reaches sync_value, or None
+    unsigned long sync_value;
+    unsigned long sync_deadline; // Waiting for counter until then if not 0
+    Bool sync_pending; // Resize once counter reached sync_value
+    unsigned long ping_deadline; // Killed then unless it answered _NET_WM_PING
+    Bool bypass; // The client set _NET_WM_BYPASS_COMPOSITOR itself
+    Bool bypassed; // xswm set _NET_WM_BYPASS_COMPOSITOR, see set_bypass()
+    unsigned long bypass_serial; // Request of the last change by xswm
+    struct Client *prev, *next;
 } Client;
 
+// Open-addressing index of clients keyed by one of their XIDs
+typedef struct {
+    Client **table;
+    unsigned long size; // Power of two, at least 2 * n
+    unsigned long n;
+    size_t key; // Offset of the XID in Client
+} Index;
+
+// Replies needed to adopt a window, requested together in one round-trip
+typedef struct {
+    xcb_get_geometry_cookie_t geometry;
+    xcb_get_property_cookie_t hints, type, transient, protocols, counter;
+    xcb_get_property_cookie_t bypass;
+} Query;
+
+// Everything needed to adopt a window, see collect()
+typedef struct {
+    Geometry geometry;
+    Bool extents;
+    Bool fixed, transient;
+    Atom type;
+    int protocols;
+    XSyncCounter counter;
+    Bool bypass;
+} Info;
+
+// Parts of Info which can be queried and cached independently
+enum {
+    InfoGeometry = 1 << 0, // Including extents
+    InfoHints = 1 << 1,
+    InfoTransient = 1 << 2,
+    InfoType = 1 << 3,
+    InfoProtocols = 1 << 4, // Including the sync-counter
+    InfoBypass = 1 << 5,
+    InfoAll = (1 << 6) - 1
+};
+
+// Protocols of WM_PROTOCOLS xswm makes use of
+enum {
+    ProtocolSync = 1 << 0,
+    ProtocolDelete = 1 << 1,
+    ProtocolPing = 1 << 2,
+};
+
+// Info of a recently withdrawn window, kept until it is remapped
+typedef struct {
+    Window w; // None if unused
+    int valid; // Parts of info which are still up to date
+    unsigned long withdrawn;
+    Info info;
+} Cached;
+
+// Remote-command, its index in commands[] is its opcode
+typedef struct {
+    const char *name;
+    void (*run)(long); // Called with the argument of the command or 0
+} Command;
+
+// Connection to the control-socket with its incomplete line
+typedef struct {
+    int fd;
+    size_t length;
+    char buffer[256];
+} Connection;
+
+// Entry of an event-log, the events of one batch share its time
+typedef struct {
+    unsigned long time; // Microseconds, see now()
+    XEvent e;
+} LogEntry;
+
+// Latencies in microseconds, bucket i counts latencies below 2^i
+enum { Buckets_N = 20 };
+typedef struct {
+    unsigned long count, sum, max;
+    unsigned long buckets[Buckets_N];
+} Histogram;
+
+// Root-property which is pushed once per batch and only if it changed
+typedef struct {
+    const int atom; // Index in net_atoms
+    const Atom type;
+    const void *value; // Format-32 items to push, owned by the caller
+    int n;
+    Bool dirty;
+    long *pushed; // Copy of the value last pushed
+    int pushed_n, pushed_size; // pushed_n is -1 before the first push
+} RootProperty;
+
+// Clients are allocated in slabs and recycled through a free-list
+enum { Slab_N = 64 };
+typedef struct Slab {
+    Client clients[Slab_N];
+    struct Slab *next;
+} Slab;
+
 // Event-Handlers
 static void button_press(const XButtonPressedEvent *);
 static void client_message(const XClientMessageEvent *);
 static void configure_notify(const XConfigureEvent *);
 static void configure_request(const XConfigureRequestEvent *);
+static void destroy_notify(const XDestroyWindowEvent *);
 static void focus_in(const XFocusInEvent *);
 static void map_request(Window);
 static void property_notify(const XPropertyEvent *);
 static void unmap_notify(const XUnmapEvent *);
 
+// Event-Loop
+static void coalesce(XEvent *, int);
+static void dispatch(XEvent *);
+static void expire(void);
+static Bool idle(void);
+static Bool is_focus_steal(const XFocusInEvent *);
+static Bool is_gone(const XEvent *, Window);
+static Bool is_superseded(const XEvent *, const XEvent *);
+static void read_signals(void);
+static void serve(void);
+
+// Event-Log
+static void log_batch(const XEvent *, int);
+static int  replay(const char *);
+
+// Control-Socket
+static void accept_connection(void);
+static int  control(void);
+static void open_socket(void);
+static void read_connection(Connection *);
+static Bool reply(Connection *, const char *);
+static Bool socket_path(struct sockaddr_un *);
+
+// Client-Pool
+static Client * client_alloc(void);
+static void client_free(Client *);
+static void pool_destroy(void);
+
+// Hash-Index
+static XID key(const Index *, const Client *);
+static unsigned long hash(const Index *, XID);
+static void index_grow(Index *);
+static void index_insert(Index *, Client *);
+static void index_remove(Index *, const Client *);
+static Client * index_get(const Index *, XID);
+
 // List-Functions
 static Client * get_client(Window);
-static Client * get_parent(const Client *);
+static void attach(Client *);
+static void detach(Client *);
 
 // Remote-Commands
-static void close(void);
-static void last(void);
-static void quit(void);
+static void close_head(long);
+static void cycle(long);
+static void end_cycle(void);
+static void focus_client(long);
+static void last(long);
+static void next(long);
+static void prev(long);
+static void quit(long);
+static void restart(long);
+static void stats(long);
+static void step(int);
+
+// Remote-Control
+static int  get_opcode(const char *);
+static int  parse_command(char *, long *);
+static void run(long, long);
+
+// Statistics
+static unsigned long now(void);
+static unsigned long percentile(const Histogram *, unsigned long);
+static void record(Histogram *, unsigned long);
+static void print_stats(char *, size_t);
+
+// Metadata-Cache
+static Cached * cache_find(Window);
+static void cache_drop(Cached *);
+static void cache_invalidate(Cached *, Atom);
+static void cache_store(const Client *);
+
+// Restart
+static Info restore(const uint32_t *);
+static void save_state(void);
+
+// Root-Properties
+static void root_flush(void);
+static void root_set(int, const void *, int);
 
 // Window-Management
+static void collect(const Query *, int, Info *);
 static void delete(Window);
 static void focus(Window);
+static Info get_info(const Client *);
+static void send_protocol(Window, Atom, long, long);
+static void grab(Window, Bool);
+static void refocus(void);
+static void manage(Window, const Info *);
 static void pop(Window);
+static void query(Window, int, Query *);
+static void raise_stacking(Window);
+static void remove_stacking(Window);
 static void resize(Client *);
+static Bool scan(void);
 static void send_configure_event(Client *);
+static void set_bypass(Client *, Bool);
+static void unmanage(Client *, Bool);
 static void update_client_list(Window);
-static void update_client_list_stacking(void);
+static void update_geometry(void);
+static void update_sync(Client *);
+static void update_state(const Client *);
+static void update_visible(void);
+
+// Sync-Requests
+static void alarm_notify(const XSyncAlarmNotifyEvent *);
+static Bool is_synced(const Client *);
+static void sync_done(Client *);
+static void sync_request(Client *);
+static void sync_timeout(void);
+
+// Pings
+static void ping_timeout(void);
 
 // Window-State
-static Bool is_fixed(Window);
-static Bool is_normal(Window);
+static XSyncCounter get_counter(xcb_get_property_cookie_t);
+static int  get_protocols(xcb_get_property_cookie_t);
+static Bool is_fixed(xcb_get_property_cookie_t);
+static Bool is_normal(Atom, Bool);
+static Bool has_property(xcb_get_property_cookie_t);
+static Atom get_type(xcb_get_property_cookie_t);
 static Bool is_floating(const Client *);
-static int  get_state(Window);
+static int  get_state(xcb_get_property_cookie_t);
+static xcb_get_property_cookie_t get_property(Window, Atom, Atom, uint32_t);
+
+// Processes
+static void autostart(void);
+static void reap(void);
 
 // X-Error-Handler
 static int xerror(Display *, XErrorEvent *);
 static int xerror_start(Display *, XErrorEvent *);
 
+#ifdef AUDIT
+// Audit
+static void audit_begin(void);
+static int  audit_int(int);
+static Atom audit_atom(Atom);
+static void * audit_reply(unsigned int);
+static size_t print_audit(char *, size_t);
+#endif
+
 // Atoms
 static Atom net_atoms[Net_N];
 static Atom wm_atoms[WM_N];
 static Atom XA_WM_CMD;
+static Atom XA_WM_STATS;
+static Atom XA_WM_RESTART;
+
+// Geometry of covered clients is updated lazily, LAZY_N per idle()
+static const int LAZY_N = 8;
+static int dirty_n = 0;
+
+// Iconify clients covered by a maximized client so they stop rendering. Off by
+// default, since clients which minimize to a tray unmap themselves when
+// iconified
+static const Bool HIDE_COVERED = False;
+
+// Let the maximized client on top bypass the compositor, unless it has a
+// preference of its own
+static const Bool BYPASS_COMPOSITOR = True;
+static Client *top; // Maximized head or NULL
+
+// Focus
+static const unsigned long REFOCUS_INTERVAL = 100000; // Microseconds
+static Window active = None; // Value of _NET_ACTIVE_WINDOW
+
+// Cycling, a session ends once cycle was not repeated for CYCLE_TIMEOUT
+static const unsigned long CYCLE_TIMEOUT = 1000000; // Microseconds
+static Window *cycle_windows; // Snapshot of the list when the session began
+static int cycle_n = 0, cycle_index; // 0 if no session is running
+
+// Sync-Requests, resizes wait for clients to redraw up to SYNC_TIMEOUT
+static const unsigned long SYNC_TIMEOUT = 1000000; // Microseconds
+static int sync_event = 0; // Type of XSyncAlarmNotify, 0 without XSync
+
+// Pings, clients closed with delete() have to answer within PING_TIMEOUT
+static const unsigned long PING_TIMEOUT = 5000000; // Microseconds
 
 // Geometry
 static const int BORDER_WIDTH = 1;
 static int sw, sh; // screen-width and -height
+static long desktop_geometry[2], workarea[4]; // Values of the root-properties
+
+// Event-Loop
+enum { Batch_N = 64 }; // Maximum number of events coalesced at once
+static XEvent batch[Batch_N];
+static unsigned long batch_time; // When the batch was read
+static int signal_fd = -1;
+
+// Timers, handled by timer_handlers[] once their deadline has passed
+enum { TimerRefocus, TimerCycle, TimerSync, TimerPing, Timer_N };
+static void (*const timer_handlers[Timer_N])(void) = {
+    [TimerRefocus] = refocus,
+    [TimerCycle] = end_cycle,
+    [TimerSync] = sync_timeout,
+    [TimerPing] = ping_timeout,
+};
+static unsigned long timers[Timer_N]; // Deadlines in microseconds, 0 if unset
+static int timer_fd = -1;
+
+// Event-Log
+static FILE *event_log; // Batches of the main-loop are appended if set
+
+// Control-Socket
+enum { Connections_N = 8 };
+static Connection connections[Connections_N];
+static int listen_fd = -1;
+
+// Client-Pool
+static Slab *slabs; // All slabs ever allocated
+static Client *pool; // Free-list of unused clients linked through next
+
+// Hash-Index
+static Index windows_index = {NULL, 0, 0, offsetof(Client, w)};
+static Index alarms_index = {NULL, 0, 0, offsetof(Client, alarm)};
 
 // Linked-List
 static Client *head; // Top-window and start of a linked-list
 static int clients_n = 0; // Number of clients in list
 
+// EWMH-Client-Lists
+static Window *client_list; // Mirror of _NET_CLIENT_LIST in mapping-order
+static Window *client_list_stacking; // Bottom-to-top
+static int client_list_size = 0; // Allocated entries of both lists
+
+// Root-Properties
+enum {
+    RootActiveWindow, RootClientList, RootClientListStacking,
+    RootDesktopGeometry, RootWorkarea, Root_N
+};
+static RootProperty root_properties[Root_N] = {
+    [RootActiveWindow] = {ActiveWindow, XA_WINDOW, .pushed_n = -1},
+    [RootClientList] = {ClientList, XA_WINDOW, .pushed_n = -1},
+    [RootClientListStacking] = {ClientListStacking, XA_WINDOW, .pushed_n = -1},
+    [RootDesktopGeometry] = {DesktopGeometry, XA_CARDINAL, .pushed_n = -1},
+    [RootWorkarea] = {Workarea, XA_CARDINAL, .pushed_n = -1},
+};
+
+// Statistics, xswm stats gives up if there is no answer within STATS_TIMEOUT
+static const int STATS_TIMEOUT = 2000; // Milliseconds
+static Histogram histograms[LASTEvent]; // Handler-latency per event-type
+static Histogram map_focus; // From reading a MapRequest to focusing
+static unsigned long coalesced_n = 0; // Events dropped by coalesce()
+static const char *event_names[LASTEvent] = {
+    [ButtonPress] = "ButtonPress",
+    [ClientMessage] = "ClientMessage",
+    [ConfigureNotify] = "ConfigureNotify",
+    [ConfigureRequest] = "ConfigureRequest",
+    [DestroyNotify] = "DestroyNotify",
+    [FocusIn] = "FocusIn",
+    [MapRequest] = "MapRequest",
+    [PropertyNotify] = "PropertyNotify",
+    [UnmapNotify] = "UnmapNotify",
+};
+
+// Remote-Control
+static const Command commands[] = {
+    {"close", close_head},
+    {"last", last},
+    {"quit", quit},
+    {"stats", stats},
+    // Appended to keep the opcodes of older versions
+    {"restart", restart},
+    {"next", next},
+    {"prev", prev},
+    {"focus", focus_client},
+    {"cycle", cycle},
+};
+static const int Commands_N = sizeof(commands) / sizeof(*commands);
+
+// Processes
+extern char **environ;
+static pid_t autostart_pid = 0; // Not started if 0, failed to start if -1
+static int autostart_status = -1; // Exit-status, -1 while running
+
+// Metadata-Cache
+enum { Cache_N = 16 };
+static const unsigned long CACHE_TIME = 10000000; // Microseconds
+static Cached cache[Cache_N]; // Ring-buffer, oldest entries are replaced
+static int cache_next = 0;
+
+// Restart, clients are handed over in fields of Record_N 32-bit items:
+// window, x, y, width, height, border-width, extents, fixed, transient, type,
+// protocols, counter, bypass. Record_Version changes with their layout or
+// meaning.
+enum { Record_N = 13, Record_Version = 3 };
+static Bool restarting = False;
+
+#ifdef AUDIT
+// Audit, indexed by event-type, 0 collects everything outside of dispatch()
+static unsigned long audit_replies[LASTEvent], audit_round_trips[LASTEvent];
+static unsigned long audit_time[LASTEvent];
+static unsigned long audit_start;
+static int audit_handler = 0;
+#endif
+
 // Misc
 static Bool running = True;
 static Display *d;
+// The xcb-connection underlying d, pipelines queries which Xlib would serialize
+// in order with the requests Xlib buffered before
+static xcb_connection_t *xc;
 static Window r; // root-window
 
 void button_press(const XButtonPressedEvent *e) {
@@ -113,16 +527,32 @@ void button_press(const XButtonPressedEvent *e) {
 
 void client_message(const XClientMessageEvent *e) {
     const Window w = e->window;
-    if (!get_client(w))
-        return;
     const Atom msg = e->message_type;
+    if (w == r) {
+        // Remote-Control
+        if (msg == XA_WM_CMD && e->format == 32)
+            run(e->data.l[0], e->data.l[1]);
+        // Answer to _NET_WM_PING, the client is still responsive
+        else if (msg == wm_atoms[Protocols]
+                && (Atom) e->data.l[0] == net_atoms[WMPing]) {
+            Client *c = get_client((Window) e->data.l[2]);
+            if (c)
+                c->ping_deadline = 0;
+        }
+        return;
+    }
+    Client *c = get_client(w);
+    if (!c)
+        return;
     if (msg == net_atoms[ActiveWindow])
         pop(w);
     else if (msg == net_atoms[CloseWindow])
         delete(w);
-    else if (msg == net_atoms[RequestFrameExtents])
+    else if (msg == net_atoms[RequestFrameExtents] && !c->extents) {
         XChangeProperty(d, w, net_atoms[FrameExtents], XA_CARDINAL, 32,
             PropModeReplace, (unsigned char *) (long []) {0, 0, 0, 0}, 4);
+        c->extents = True;
+    }
 }
 
 void configure_notify(const XConfigureEvent *e) {
@@ -131,12 +561,18 @@ void configure_notify(const XConfigureEvent *e) {
     if (e->window != r || (sw == width && sh == height))
         return;
     sw = width, sh = height;
-    XChangeProperty(d, r, net_atoms[DesktopGeometry], XA_CARDINAL, 32,
-        PropModeReplace, (unsigned char *) (long []) {sw, sh}, 2);
-    XChangeProperty(d, r, net_atoms[Workarea], XA_CARDINAL, 32,
-        PropModeReplace, (unsigned char *) (long []) {0, 0, sw, sh}, 4);
-    for (Client *c = head; c; c = c->next)
-        resize(c);
+    update_geometry();
+    // Only resize what is visible now, the rest is resized lazily
+    Bool covered = False;
+    for (Client *c = head; c; c = c->next) {
+        if (!covered) {
+            resize(c);
+            covered = !is_floating(c);
+        } else if (!c->dirty) {
+            c->dirty = True;
+            dirty_n++;
+        }
+    }
 }
 
 void configure_request(const XConfigureRequestEvent *e) {
@@ -147,10 +583,14 @@ void configure_request(const XConfigureRequestEvent *e) {
         if (value_mask & CWBorderWidth) c->border_width_request = e->border_width;
         if (value_mask & CWWidth) c->width_request = e->width;
         if (value_mask & CWHeight) c->height_request = e->height;
+        // Requests are always answered, even if nothing changes (ICCCM 4.1.5)
+        c->event.width = -1;
         if (value_mask & (CWWidth | CWHeight) && is_floating(c))
             resize(c);
         else send_configure_event(c);
-    } else XConfigureWindow(d, w, (unsigned int) value_mask, &(XWindowChanges) {
+        return;
+    }
+    XConfigureWindow(d, w, (unsigned int) value_mask, &(XWindowChanges) {
         .x = e->x,
         .y = e->y,
         .width = e->width,
@@ -159,48 +599,69 @@ void configure_request(const XConfigureRequestEvent *e) {
         .sibling = e->above,
         .stack_mode = e->detail,
     });
+    // Keep cached geometry of withdrawn windows up to date
+    Cached *cached = cache_find(w);
+    if (!cached)
+        return;
+    Geometry *geometry = &cached->info.geometry;
+    if (value_mask & CWX) geometry->x = e->x;
+    if (value_mask & CWY) geometry->y = e->y;
+    if (value_mask & CWWidth) geometry->width = e->width;
+    if (value_mask & CWHeight) geometry->height = e->height;
+    if (value_mask & CWBorderWidth) geometry->border_width = e->border_width;
+}
+
+// Windows are usually unmapped before being destroyed, but not always
+void destroy_notify(const XDestroyWindowEvent *e) {
+    Client *c = get_client(e->window);
+    Cached *cached;
+    if (c)
+        unmanage(c, True);
+    else if ((cached = cache_find(e->window)))
+        cached->w = None;
 }
 
-// Prevent bad clients from stealing focus
+// Focus-changes caused by grabs or inside a window are no steals, shared by
+// focus_in() and coalesce() so only steals supersede each other
+Bool is_focus_steal(const XFocusInEvent *e) {
+    return e->mode != NotifyGrab && e->mode != NotifyUngrab
+        && e->detail != NotifyInferior && e->detail != NotifyPointer;
+}
+
+// Prevent bad clients from stealing focus. A client stealing focus again
+// within REFOCUS_INTERVAL only gets it taken back once the interval has
+// passed.
 void focus_in(const XFocusInEvent *e) {
-    if (head && head->w != e->window)
-        focus(head->w);
+    if (!head || head->w == e->window || !is_focus_steal(e))
+        return;
+    Client *c = get_client(e->window);
+    const unsigned long time = now();
+    if (c && time - c->refocused < REFOCUS_INTERVAL) {
+        if (!timers[TimerRefocus])
+            timers[TimerRefocus] = c->refocused + REFOCUS_INTERVAL;
+        return;
+    }
+    if (c)
+        c->refocused = time;
+    focus(head->w);
 }
 
 void map_request(const Window w) {
     if (get_client(w))
         return;
-    // Get geometry
-    int x = -BORDER_WIDTH, y = -BORDER_WIDTH;
-    unsigned int width  = (unsigned int) sw;
-    unsigned int height = (unsigned int) sh;
-    XGetGeometry(d, w, &(Window) {None}, &x, &y, &width, &height,
-        &(unsigned int) {None}, &(unsigned int) {None});
-    // Initialize client and add to linked-list
-    memcpy(head = malloc(sizeof(Client)), &(Client) {w, is_fixed(w),
-        is_normal(w), (int) width, (int) height, BORDER_WIDTH,
-        x, y, (int) width, (int) height, head}, sizeof(Client));
-    clients_n++;
-    // Update ewmh-client-lists
-    XChangeProperty(d, r, net_atoms[ClientList], XA_WINDOW, 32,
-        PropModeAppend, (unsigned char *) &w, 1);
-    XChangeProperty(d, r, net_atoms[ClientListStacking], XA_WINDOW, 32,
-        PropModeAppend, (unsigned char *) &w, 1);
-    // Configure
-    XChangeProperty(d, w, net_atoms[FrameExtents], XA_CARDINAL, 32,
-        PropModeReplace, (unsigned char *) (long []) {0, 0, 0, 0}, 4);
-    XChangeProperty(d, w, net_atoms[WMDesktop], XA_CARDINAL, 32,
-        PropModeReplace, (unsigned char *) (int []) {0}, 1);
-    XGrabButton(d, AnyButton, AnyModifier, w, True, ButtonPressMask,
-        GrabModeSync, GrabModeSync, None, None);
-    XSelectInput(d, w, FocusChangeMask | PropertyChangeMask);
-    XSetWindowBorderWidth(d, w, BORDER_WIDTH);
-    resize(head);
-    // Map
-    XChangeProperty(d, w, wm_atoms[State], wm_atoms[State], 32,
-        PropModeReplace, (unsigned char *) (long []) {NormalState, None}, 2);
-    XMapWindow(d, w);
-    focus(w);
+    // Only query what is not cached
+    Cached *cached = cache_find(w);
+    const int parts = cached ? InfoAll & ~cached->valid : InfoAll;
+    Query q = {{0}, {0}, {0}, {0}, {0}, {0}, {0}};
+    Info info;
+    if (cached) {
+        info = cached->info;
+        cached->w = None;
+    }
+    query(w, parts, &q);
+    collect(&q, parts, &info);
+    manage(w, &info);
+    record(&map_focus, now() - batch_time);
 }
 
 void property_notify(const XPropertyEvent *e) {
@@ -208,95 +669,849 @@ void property_notify(const XPropertyEvent *e) {
     const Window w = e->window;
     const Atom property = e->atom;
     if (w == r) {
-        // Remote-Control
+        // Remote-Control (superseded by ClientMessages, see main())
         if (property != XA_WM_CMD)
             return;
         XTextProperty p;
-        if (!XGetTextProperty(d, r, &p, XA_WM_CMD) || !p.value)
+        if (!AUDIT_INT(XGetTextProperty(d, r, &p, XA_WM_CMD)) || !p.value)
             return;
-        const int cmd_size = 8;
+        const int cmd_size = 32;
         char cmd[cmd_size];
         strncpy(cmd, (char *) p.value, cmd_size - 1);
         cmd[cmd_size - 1] = '\0';
-        if      (!strcmp(cmd, "last"))  last();
-        else if (!strcmp(cmd, "close")) close();
-        else if (!strcmp(cmd, "quit"))  quit();
+        long arg;
+        const int opcode = parse_command(cmd, &arg);
+        run(opcode, arg);
         XFree(p.value);
-    } else if ((c = get_client(w)) && (property == XA_WM_NORMAL_HINTS
-            || property == net_atoms[WMWindowType])) {
+    } else if (!(c = get_client(w))) {
+        Cached *cached = cache_find(w);
+        if (cached)
+            cache_invalidate(cached, property);
+    } else if (property == XA_WM_NORMAL_HINTS
+            || property == XA_WM_TRANSIENT_FOR
+            || property == net_atoms[WMWindowType]) {
+        // Only re-query the property which changed
         Bool floating_old = is_floating(c);
         if (property == XA_WM_NORMAL_HINTS)
-            c->fixed = is_fixed(w);
-        else if (property == net_atoms[WMWindowType])
-            c->normal = is_normal(w);
-        if (floating_old != is_floating(c))
+            c->fixed = is_fixed(get_property(w, XA_WM_NORMAL_HINTS,
+                XA_WM_SIZE_HINTS, 18));
+        else if (property == XA_WM_TRANSIENT_FOR)
+            c->transient = has_property(get_property(w, XA_WM_TRANSIENT_FOR,
+                XA_WINDOW, 1));
+        else
+            c->type = get_type(get_property(w, net_atoms[WMWindowType],
+                XA_ATOM, 1));
+        if (floating_old != is_floating(c)) {
             resize(c);
+            update_visible();
+        }
+    } else if (property == wm_atoms[Protocols]
+            || property == net_atoms[WMSyncRequestCounter]) {
+        Query q;
+        query(w, InfoProtocols, &q);
+        Info info;
+        collect(&q, InfoProtocols, &info);
+        c->protocols = info.protocols;
+        c->counter = info.counter;
+        update_sync(c);
+    } else if (property == net_atoms[WMBypassCompositor]
+            && e->serial != c->bypass_serial) {
+        // Changed by the client, which replaces any value of xswm
+        c->bypass = e->state == PropertyNewValue;
+        c->bypassed = False;
+        if (c == top)
+            set_bypass(c, True);
     }
 }
 
 void unmap_notify(const XUnmapEvent *e) {
-    const Window w = e->window;
-    Client *c = get_client(w);
-    if (!c)
+    Client *c = get_client(e->window);
+    if (c)
+        unmanage(c, False);
+}
+
+// Drop events which are made redundant by a later event in the same batch
+void coalesce(XEvent *events, const int events_n) {
+    for (int i = 0; i < events_n - 1; i++)
+        for (int j = i + 1; j < events_n; j++)
+            if (is_superseded(&events[i], &events[j])) {
+                events[i].type = 0;
+                coalesced_n++;
+                break;
+            }
+}
+
+void dispatch(XEvent *e) {
+    if (!e->type)
+        return;
+    // Extension-events are not recorded in the statistics
+    if (e->type >= LASTEvent) {
+        if (sync_event && e->type == sync_event)
+            alarm_notify((XSyncAlarmNotifyEvent *) e);
         return;
-    // Handle window
-    XGrabServer(d); // Avoid race-conditions
-    XSelectInput(d, w, NoEventMask);
-    XUngrabButton(d, AnyButton, AnyModifier, w);
-    XDeleteProperty(d, w, net_atoms[WMDesktop]);
-    XChangeProperty(d, w, wm_atoms[State], wm_atoms[State], 32,
-        PropModeReplace, (unsigned char *) (long []) {WithdrawnState, None}, 2);
-    XSync(d, False);
-    XUngrabServer(d);
-    // Update list
-    if (c != head)
-        get_parent(c)->next = c->next;
-    else if (clients_n == 1) {
-        XChangeProperty(d, r, net_atoms[ActiveWindow], XA_WINDOW, 32,
-            PropModeReplace, None, 0);
-        head = NULL;
-    } else {
-        head = head->next;
-        focus(head->w);
     }
-    free(c);
-    clients_n--;
-    update_client_list(w);
-    update_client_list_stacking();
+    const unsigned long start = now();
+#ifdef AUDIT
+    audit_handler = e->type;
+#endif
+    switch (e->type) {
+        case ButtonPress: button_press(&e->xbutton); break;
+        case ClientMessage: client_message(&e->xclient); break;
+        case ConfigureNotify: configure_notify(&e->xconfigure); break;
+        case ConfigureRequest: configure_request(&e->xconfigurerequest); break;
+        case FocusIn: focus_in(&e->xfocus); break;
+        case DestroyNotify: destroy_notify(&e->xdestroywindow); break;
+        case MapRequest: map_request(e->xmaprequest.window); break;
+        case PropertyNotify: property_notify(&e->xproperty); break;
+        case UnmapNotify: unmap_notify(&e->xunmap); break;
+    }
+#ifdef AUDIT
+    audit_handler = 0;
+#endif
+    record(&histograms[e->type], now() - start);
 }
 
-Client * get_client(const Window w) {
-    Client *c;
-    for (c = head; c && c->w != w; c = c->next);
+// Whether the later event withdraws w
+Bool is_gone(const XEvent *later, const Window w) {
+    return (later->type == UnmapNotify && later->xunmap.window == w)
+        || (later->type == DestroyNotify && later->xdestroywindow.window == w);
+}
+
+void expire(void) {
+    read(timer_fd, &(uint64_t) {0}, sizeof(uint64_t));
+    const unsigned long time = now();
+    for (int i = 0; i < Timer_N; i++)
+        if (timers[i] && timers[i] <= time) {
+            timers[i] = 0;
+            timer_handlers[i]();
+        }
+}
+
+// Work which can wait until all queued events are handled, returns whether
+// there is work left for the next call
+Bool idle(void) {
+    root_flush();
+    int resized_n = 0;
+    for (Client *c = head; c && dirty_n && resized_n < LAZY_N; c = c->next)
+        if (c->dirty) {
+            resize(c);
+            resized_n++;
+        }
+    return dirty_n ? True : False;
+}
+
+Bool is_superseded(const XEvent *e, const XEvent *later) {
+    const Window w = e->xany.window;
+    switch (e->type) {
+        // Only the final root-geometry matters
+        case ConfigureNotify:
+            return w == r && later->type == ConfigureNotify
+                && later->xconfigure.window == r;
+        // Only the final focus is corrected by focus_in()
+        case FocusIn:
+            return (later->type == FocusIn && is_focus_steal(&later->xfocus))
+                || is_gone(later, w);
+        // Re-evaluate hints once per window (remote-commands are kept)
+        case PropertyNotify:
+            if (w == r)
+                return False;
+            // Changes before an unmap still invalidate the metadata-cache
+            if (later->type == DestroyNotify
+                    && later->xdestroywindow.window == w)
+                return True;
+            return later->type == PropertyNotify && later->xproperty.window == w
+                && later->xproperty.atom == e->xproperty.atom
+                && (e->xproperty.atom == XA_WM_NORMAL_HINTS
+                    || e->xproperty.atom == XA_WM_TRANSIENT_FOR
+                    || e->xproperty.atom == net_atoms[WMWindowType]);
+        // The client is gone before the message could be acted upon
+        case ClientMessage:
+            return w != r && is_gone(later, w);
+    }
+    return False;
+}
+
+// Run deferred work, flush and block until the X-connection is readable
+// while serving signals, timers and the control-socket
+void serve(void) {
+    const Bool busy = idle();
+    XFlush(d);
+    // Flushing may have read events into the queue, which leaves the
+    // connection unreadable although they wait to be handled
+    const Bool queued = XEventsQueued(d, QueuedAfterReading) > 0;
+    // Arm the timer-fd for the earliest deadline, or disarm it
+    unsigned long deadline = 0;
+    for (int i = 0; i < Timer_N; i++)
+        if (timers[i] && (!deadline || timers[i] < deadline))
+            deadline = timers[i];
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &(struct itimerspec) {
+        .it_value.tv_sec = (time_t) (deadline / 1000000),
+        .it_value.tv_nsec = (long) (deadline % 1000000) * 1000,
+    }, NULL);
+    struct pollfd fds[4 + Connections_N];
+    nfds_t fds_n = 0;
+    fds[fds_n++] = (struct pollfd) {ConnectionNumber(d), POLLIN, 0};
+    fds[fds_n++] = (struct pollfd) {signal_fd, POLLIN, 0};
+    fds[fds_n++] = (struct pollfd) {timer_fd, POLLIN, 0};
+    if (listen_fd >= 0)
+        fds[fds_n++] = (struct pollfd) {listen_fd, POLLIN, 0};
+    for (int i = 0; i < Connections_N; i++)
+        if (connections[i].fd >= 0)
+            fds[fds_n++] = (struct pollfd) {connections[i].fd, POLLIN, 0};
+    if (poll(fds, fds_n, busy || queued ? 0 : -1) <= 0)
+        return;
+    for (nfds_t i = 1; i < fds_n; i++) {
+        if (!fds[i].revents)
+            continue;
+        if (fds[i].fd == signal_fd)
+            read_signals();
+        else if (fds[i].fd == timer_fd)
+            expire();
+        else if (fds[i].fd == listen_fd)
+            accept_connection();
+        else for (int j = 0; j < Connections_N; j++)
+            if (connections[j].fd == fds[i].fd)
+                read_connection(&connections[j]);
+    }
+}
+
+void log_batch(const XEvent *events, const int events_n) {
+    for (int i = 0; i < events_n; i++)
+        fwrite(&(LogEntry) {batch_time, events[i]}, sizeof(LogEntry), 1,
+            event_log);
+}
+
+// Feed the batches of an event-log through coalesce() and dispatch() as fast
+// as possible and print the statistics. The windows of the recorded session
+// are usually gone, so the requests cost what they cost but fail silently.
+int replay(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: Unable to open %s.\n", path);
+        return EXIT_FAILURE;
+    }
+    LogEntry entry;
+    Bool more = fread(&entry, sizeof(entry), 1, f) == 1;
+    while (more && running) {
+        const unsigned long time = entry.time;
+        int batch_n = 0;
+        while (more && batch_n < Batch_N && entry.time == time) {
+            batch[batch_n] = entry.e;
+            batch[batch_n++].xany.display = d;
+            more = fread(&entry, sizeof(entry), 1, f) == 1;
+        }
+        batch_time = now();
+        coalesce(batch, batch_n);
+        for (int i = 0; i < batch_n && running; i++)
+            dispatch(&batch[i]);
+        expire();
+        while (idle());
+        XFlush(d);
+    }
+    fclose(f);
+    // A recorded restart or quit only ends the replay
+    restarting = False;
+    char text[4096];
+    print_stats(text, sizeof(text));
+    fputs(text, stdout);
+    return EXIT_SUCCESS;
+}
+
+// SIGHUP restarts, SIGINT and SIGTERM quit cleanly
+void read_signals(void) {
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+        if (info.ssi_signo == SIGCHLD)
+            reap();
+        else if (info.ssi_signo == SIGHUP)
+            restart(0);
+        else
+            running = False;
+}
+
+void accept_connection(void) {
+    const int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    for (int i = 0; i < Connections_N; i++)
+        if (connections[i].fd < 0) {
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            connections[i].fd = fd;
+            connections[i].length = 0;
+            return;
+        }
+    close(fd);
+}
+
+// Thin client which pipes stdin to the control-socket and replies to stdout
+int control(void) {
+    struct sockaddr_un address;
+    int fd = -1;
+    if (!socket_path(&address) || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+            || connect(fd, (struct sockaddr *) &address, sizeof(address))) {
+        fprintf(stderr, "Error: Unable to connect to the control-socket.\n");
+        if (fd >= 0)
+            close(fd);
+        return EXIT_FAILURE;
+    }
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+    char buffer[4096];
+    while (poll(fds, 2, -1) > 0) {
+        if (fds[0].revents) {
+            const ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (n <= 0) {
+                // Replies to everything sent so far still arrive
+                shutdown(fd, SHUT_WR);
+                fds[0].fd = -1;
+            } else if (write(fd, buffer, (size_t) n) != n)
+                break;
+        }
+        if (fds[1].revents) {
+            const ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n <= 0)
+                break;
+            fwrite(buffer, 1, (size_t) n, stdout);
+            fflush(stdout);
+        }
+    }
+    close(fd);
+    return EXIT_SUCCESS;
+}
+
+// The control-socket is optional and only served if its path is known
+void open_socket(void) {
+    for (int i = 0; i < Connections_N; i++)
+        connections[i].fd = -1;
+    struct sockaddr_un address;
+    if (!socket_path(&address)
+            || (listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return;
+    unlink(address.sun_path);
+    if (bind(listen_fd, (struct sockaddr *) &address, sizeof(address))
+            || listen(listen_fd, Connections_N)) {
+        close(listen_fd);
+        listen_fd = -1;
+        return;
+    }
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+    fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+}
+
+// Run every complete line as a command and keep the rest for later
+void read_connection(Connection *c) {
+    const ssize_t n = read(c->fd, c->buffer + c->length,
+        sizeof(c->buffer) - c->length);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+    c->length += (size_t) n;
+    char *line = c->buffer, *end;
+    while ((end = memchr(line, '\n', c->length - (size_t) (line - c->buffer)))) {
+        *end = '\0';
+        if (end > line && end[-1] == '\r')
+            end[-1] = '\0';
+        long arg;
+        const int opcode = parse_command(line, &arg);
+        if (*line && opcode < 0) {
+            if (!reply(c, "error: unknown command\n"))
+                return;
+        } else if (*line) {
+            run(opcode, arg);
+            char text[4096] = "ok\n";
+            if (commands[opcode].run == stats)
+                print_stats(text, sizeof(text));
+            if (!reply(c, text))
+                return;
+        }
+        line = end + 1;
+    }
+    c->length -= (size_t) (line - c->buffer);
+    if (c->length == sizeof(c->buffer)) {
+        if (!reply(c, "error: line too long\n"))
+            return;
+        c->length = 0;
+    }
+    memmove(c->buffer, line, c->length);
+}
+
+// Replies are not buffered, so a client which does not take a reply at once
+// is disconnected instead of receiving it truncated
+Bool reply(Connection *c, const char *text) {
+    const size_t length = strlen(text);
+    if (send(c->fd, text, length, MSG_NOSIGNAL) == (ssize_t) length)
+        return True;
+    close(c->fd);
+    c->fd = -1;
+    return False;
+}
+
+// $XDG_RUNTIME_DIR/xswm$DISPLAY.sock
+Bool socket_path(struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    const char *dir = getenv("XDG_RUNTIME_DIR"), *display = getenv("DISPLAY");
+    if (!dir || !display)
+        return False;
+    const int n = snprintf(address->sun_path, sizeof(address->sun_path),
+        "%s/xswm%s.sock", dir, display);
+    return n > 0 && (size_t) n < sizeof(address->sun_path);
+}
+
+Client * client_alloc(void) {
+    if (!pool) {
+        // Thread a fresh slab onto the free-list, first client on top
+        Slab *slab = malloc(sizeof(Slab));
+        slab->next = slabs;
+        slabs = slab;
+        for (int i = Slab_N - 1; i >= 0; i--) {
+            slab->clients[i].next = pool;
+            pool = &slab->clients[i];
+        }
+    }
+    Client *c = pool;
+    pool = pool->next;
     return c;
 }
 
-Client * get_parent(const Client *c) {
-    if (!c || c == head)
+void client_free(Client *c) {
+    c->next = pool;
+    pool = c;
+}
+
+void pool_destroy(void) {
+    while (slabs) {
+        Slab *old_slab = slabs;
+        slabs = slabs->next;
+        free(old_slab);
+    }
+    pool = head = NULL;
+}
+
+XID key(const Index *index, const Client *c) {
+    return *(const XID *) ((const char *) c + index->key);
+}
+
+unsigned long hash(const Index *index, const XID x) {
+    unsigned long h = (unsigned long) x;
+    h ^= h >> 16;
+    h *= 0x45d9f3bUL;
+    h ^= h >> 16;
+    return h & (index->size - 1);
+}
+
+void index_grow(Index *index) {
+    Client **old = index->table;
+    const unsigned long old_size = index->size;
+    index->size = index->size ? index->size * 2 : 16;
+    index->table = calloc(index->size, sizeof(Client *));
+    index->n = 0;
+    for (unsigned long i = 0; i < old_size; i++)
+        if (old[i])
+            index_insert(index, old[i]);
+    free(old);
+}
+
+void index_insert(Index *index, Client *c) {
+    // Keep the load-factor at or below 1/2 so probe-sequences stay short
+    if ((index->n + 1) * 2 > index->size)
+        index_grow(index);
+    unsigned long i;
+    for (i = hash(index, key(index, c)); index->table[i];
+        i = (i + 1) & (index->size - 1));
+    index->table[i] = c;
+    index->n++;
+}
+
+void index_remove(Index *index, const Client *c) {
+    Client **table = index->table;
+    const unsigned long mask = index->size - 1;
+    unsigned long i;
+    for (i = hash(index, key(index, c)); table[i] != c; i = (i + 1) & mask);
+    // Shift following entries back so no tombstones are needed
+    for (unsigned long j = (i + 1) & mask; table[j]; j = (j + 1) & mask) {
+        const unsigned long k = hash(index, key(index, table[j]));
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i] = NULL;
+    index->n--;
+}
+
+Client * index_get(const Index *index, const XID x) {
+    if (!index->size)
         return NULL;
-    Client *p;
-    for (p = head; p && p->next != c; p = p->next);
-    return p;
+    Client **table = index->table;
+    unsigned long i;
+    for (i = hash(index, x); table[i] && key(index, table[i]) != x;
+        i = (i + 1) & (index->size - 1));
+    return table[i];
+}
+
+Client * get_client(const Window w) { return index_get(&windows_index, w); }
+
+// Push c on top of the list
+void attach(Client *c) {
+    c->prev = NULL;
+    c->next = head;
+    if (head)
+        head->prev = c;
+    head = c;
+}
+
+void detach(Client *c) {
+    if (c->prev)
+        c->prev->next = c->next;
+    else head = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+}
+
+void close_head(const long arg) {
+    (void) arg;
+    if (clients_n > 0)
+        delete(head->w);
+}
+
+// Walk the clients in most-recently-used order while cycle is repeated
+// within CYCLE_TIMEOUT. The walk follows a snapshot of the list taken when
+// the session began, since every step moves the chosen client to head.
+void cycle(const long arg) {
+    (void) arg;
+    if (clients_n < 2)
+        return;
+    if (!cycle_n) {
+        cycle_windows = realloc(cycle_windows,
+            (size_t) clients_n * sizeof(Window));
+        for (Client *c = head; c; c = c->next)
+            cycle_windows[cycle_n++] = c->w;
+        cycle_index = 0;
+    }
+    timers[TimerCycle] = now() + CYCLE_TIMEOUT;
+    // Skip windows which were unmanaged during the session
+    for (int i = 0; i < cycle_n; i++) {
+        cycle_index = (cycle_index + 1) % cycle_n;
+        if (get_client(cycle_windows[cycle_index])) {
+            pop(cycle_windows[cycle_index]);
+            return;
+        }
+    }
+}
+
+void end_cycle(void) { cycle_n = 0; }
+
+// Focus the client with the window-id arg, or else the arg-th client in
+// mapping-order like in _NET_CLIENT_LIST
+void focus_client(const long arg) {
+    if (get_client((Window) arg))
+        pop((Window) arg);
+    else if (arg >= 0 && arg < clients_n)
+        pop(client_list[arg]);
+}
+
+void last(const long arg) {
+    (void) arg;
+    if (clients_n > 1)
+        pop(head->next->w);
 }
 
-void close(void) { if (clients_n > 0) delete(head->w); }
+void next(const long arg) { (void) arg; step(1); }
+
+void prev(const long arg) { (void) arg; step(-1); }
 
-void last(void) { if (clients_n > 1) pop(head->next->w); }
+void quit(const long arg) { (void) arg; running = False; }
+
+// Quit and exec argv[0] which adopts the clients from save_state()
+void restart(const long arg) { (void) arg; restarting = True, running = False; }
+
+// Focus the client mapped after or before head, in contrast to the
+// most-recently-used order this one does not change when focusing
+void step(const int direction) {
+    if (clients_n < 2)
+        return;
+    int i;
+    for (i = 0; i < clients_n && client_list[i] != head->w; i++);
+    pop(client_list[(i + direction + clients_n) % clients_n]);
+}
+
+// Publish the statistics in the _XSWM_STATS property on the root-window
+void stats(const long arg) {
+    (void) arg;
+    char text[4096];
+    print_stats(text, sizeof(text));
+    XChangeProperty(d, r, XA_WM_STATS, XA_STRING, 8, PropModeReplace,
+        (unsigned char *) text, (int) strlen(text));
+}
+
+int get_opcode(const char *name) {
+    for (int opcode = 0; opcode < Commands_N; opcode++)
+        if (!strcmp(commands[opcode].name, name))
+            return opcode;
+    return -1;
+}
+
+// Split "name [argument]" into the opcode and the argument, which may be
+// decimal or hexadecimal like window-ids
+int parse_command(char *line, long *arg) {
+    char *space = strchr(line, ' ');
+    *arg = 0;
+    if (space) {
+        *space = '\0';
+        *arg = strtol(space + 1, NULL, 0);
+    }
+    return get_opcode(line);
+}
+
+void run(const long opcode, const long arg) {
+    if (opcode >= 0 && opcode < Commands_N)
+        commands[opcode].run(arg);
+}
+
+unsigned long now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long) t.tv_sec * 1000000
+        + (unsigned long) t.tv_nsec / 1000;
+}
 
-void quit(void) { running = False; }
+// Upper bound of the bucket containing the given percentile, the last bucket
+// is open-ended so the maximum bounds it
+unsigned long percentile(const Histogram *h, const unsigned long p) {
+    unsigned long count = 0;
+    int i;
+    for (i = 0; i < Buckets_N - 1; i++)
+        if ((count += h->buckets[i]) * 100 >= h->count * p)
+            break;
+    return i < Buckets_N - 1 && (1UL << i) - 1 < h->max ? (1UL << i) - 1
+        : h->max;
+}
+
+void record(Histogram *h, const unsigned long latency) {
+    int i;
+    for (i = 0; i < Buckets_N - 1 && latency >= 1UL << i; i++);
+    h->buckets[i]++;
+    h->count++;
+    h->sum += latency;
+    if (latency > h->max)
+        h->max = latency;
+}
+
+void print_stats(char *text, const size_t size) {
+    size_t n = 0;
+    text[0] = '\0';
+    for (int i = 0; i <= LASTEvent && n < size; i++) {
+        const Histogram *h = i < LASTEvent ? &histograms[i] : &map_focus;
+        const char *name = i < LASTEvent ? event_names[i] : "MapFocus";
+        if (!name || !h->count)
+            continue;
+        n += (size_t) snprintf(text + n, size - n, "%-16s count=%lu avg=%luus "
+            "p50<=%luus p99<=%luus max=%luus\n", name, h->count,
+            h->sum / h->count, percentile(h, 50), percentile(h, 99), h->max);
+    }
+#ifdef AUDIT
+    if (n < size)
+        n += print_audit(text + n, size - n);
+#endif
+    if (n < size)
+        n += (size_t) snprintf(text + n, size - n, "%-16s count=%lu\n",
+            "Coalesced", coalesced_n);
+    if (n < size && autostart_pid < 0)
+        snprintf(text + n, size - n, "%-16s failed\n", "Autostart");
+    else if (n < size && autostart_pid && autostart_status < 0)
+        snprintf(text + n, size - n, "%-16s pid=%d running\n", "Autostart",
+            (int) autostart_pid);
+    else if (n < size && autostart_pid)
+        snprintf(text + n, size - n, "%-16s pid=%d status=%d\n", "Autostart",
+            (int) autostart_pid, autostart_status);
+}
+
+// Find the cached info of w, expired entries are dropped on the way
+Cached * cache_find(const Window w) {
+    const unsigned long time = now();
+    for (int i = 0; i < Cache_N; i++) {
+        Cached *cached = &cache[i];
+        if (cached->w != None && time - cached->withdrawn > CACHE_TIME)
+            cache_drop(cached);
+        else if (cached->w != None && cached->w == w)
+            return cached;
+    }
+    return NULL;
+}
+
+void cache_drop(Cached *cached) {
+    XSelectInput(d, cached->w, NoEventMask);
+    cached->w = None;
+}
+
+void cache_invalidate(Cached *cached, const Atom property) {
+    if (property == XA_WM_NORMAL_HINTS)
+        cached->valid &= ~InfoHints;
+    else if (property == XA_WM_TRANSIENT_FOR)
+        cached->valid &= ~InfoTransient;
+    else if (property == net_atoms[WMWindowType])
+        cached->valid &= ~InfoType;
+    else if (property == wm_atoms[Protocols]
+            || property == net_atoms[WMSyncRequestCounter])
+        cached->valid &= ~InfoProtocols;
+    else if (property == net_atoms[WMBypassCompositor])
+        cached->valid &= ~InfoBypass;
+}
+
+// Remember the info of c while it is withdrawn. Property-changes are still
+// selected so entries can be invalidated precisely.
+void cache_store(const Client *c) {
+    Cached *cached = &cache[cache_next];
+    cache_next = (cache_next + 1) % Cache_N;
+    if (cached->w != None)
+        cache_drop(cached);
+    *cached = (Cached) {c->w, InfoAll, now(), get_info(c)};
+    XSelectInput(d, c->w, PropertyChangeMask);
+}
+
+// Parse a record of save_state() for manage()
+Info restore(const uint32_t *record) {
+    return (Info) {
+        .geometry = {(int32_t) record[1], (int32_t) record[2],
+            (int32_t) record[3], (int32_t) record[4], (int32_t) record[5]},
+        .extents = record[6] ? True : False,
+        .fixed = record[7] ? True : False,
+        .transient = record[8] ? True : False,
+        .type = record[9],
+        .protocols = (int) record[10],
+        .counter = record[11],
+        .bypass = record[12] ? True : False,
+    };
+}
+
+// Hand the clients over to the next process in the _XSWM_RESTART property.
+// Record_Version and the autostart-process precede the clients in
+// bottom-to-top order, so scan() can restore them without any queries.
+void save_state(void) {
+    const size_t size = (size_t) (3 + clients_n * Record_N) * sizeof(long);
+    long *state = malloc(size), *p = state;
+    *p++ = Record_Version, *p++ = autostart_pid, *p++ = autostart_status;
+    Client *c = head;
+    while (c && c->next)
+        c = c->next;
+    for (; c; c = c->prev) {
+        const Info info = get_info(c);
+        const Geometry *g = &info.geometry;
+        *p++ = (long) c->w;
+        *p++ = g->x, *p++ = g->y, *p++ = g->width, *p++ = g->height;
+        *p++ = g->border_width, *p++ = info.extents;
+        *p++ = info.fixed, *p++ = info.transient, *p++ = (long) info.type;
+        *p++ = info.protocols, *p++ = (long) info.counter, *p++ = info.bypass;
+    }
+    XChangeProperty(d, r, XA_WM_RESTART, XA_CARDINAL, 32, PropModeReplace,
+        (unsigned char *) state, (int) (p - state));
+    free(state);
+}
+
+// Push the dirty root-properties, dropping values which are already set
+void root_flush(void) {
+    for (int i = 0; i < Root_N; i++) {
+        RootProperty *p = &root_properties[i];
+        if (!p->dirty)
+            continue;
+        p->dirty = False;
+        const size_t size = (size_t) p->n * sizeof(long);
+        if (p->n == p->pushed_n
+                && (!p->n || !memcmp(p->value, p->pushed, size)))
+            continue;
+        XChangeProperty(d, r, net_atoms[p->atom], p->type, 32,
+            PropModeReplace, p->value, p->n);
+        if (p->n > p->pushed_size) {
+            p->pushed = realloc(p->pushed, size);
+            p->pushed_size = p->n;
+        }
+        if (p->n)
+            memcpy(p->pushed, p->value, size);
+        p->pushed_n = p->n;
+    }
+}
+
+// Mark a root-property dirty, value has to stay valid until root_flush()
+void root_set(const int property, const void *value, const int n) {
+    RootProperty *p = &root_properties[property];
+    p->value = value;
+    p->n = n;
+    p->dirty = True;
+}
 
+// Wait for the replies of query() and fill in the given parts of info
+void collect(const Query *q, const int parts, Info *info) {
+    if (parts & InfoGeometry) {
+        // Unknown border-width and extents are always set by manage()
+        info->geometry = (Geometry) {-BORDER_WIDTH, -BORDER_WIDTH, sw, sh, -1};
+        info->extents = False;
+        xcb_get_geometry_reply_t *geometry =
+            AUDIT_REPLY(xcb_get_geometry_reply(xc, q->geometry, NULL),
+                q->geometry);
+        if (geometry) {
+            info->geometry = (Geometry) {geometry->x, geometry->y,
+                geometry->width, geometry->height, geometry->border_width};
+            free(geometry);
+        }
+    }
+    if (parts & InfoHints)
+        info->fixed = is_fixed(q->hints);
+    if (parts & InfoTransient)
+        info->transient = has_property(q->transient);
+    if (parts & InfoType)
+        info->type = get_type(q->type);
+    if (parts & InfoProtocols) {
+        info->protocols = get_protocols(q->protocols);
+        info->counter = get_counter(q->counter);
+    }
+    if (parts & InfoBypass)
+        info->bypass = has_property(q->bypass);
+}
+
+// Ask the client to close w, or kill it if it can not be asked. Clients
+// supporting _NET_WM_PING are killed if they do not answer within
+// PING_TIMEOUT, see ping_timeout().
 void delete(const Window w) {
-    Atom protocol = wm_atoms[DeleteWindow];
-    Atom *protocols;
-    int count;
-    if (!XGetWMProtocols(d, w, &protocols, &count))
+    Client *c = get_client(w);
+    if (!c)
         return;
-    Bool protocol_exists = False;
-    while (!protocol_exists && count--)
-        protocol_exists = protocols[count] == protocol;
-    XFree(protocols);
-    if (!protocol_exists)
+    if (!(c->protocols & ProtocolDelete)) {
+        XKillClient(d, w);
+        return;
+    }
+    send_protocol(w, wm_atoms[DeleteWindow], 0, 0);
+    if (!(c->protocols & ProtocolPing) || c->ping_deadline)
+        return;
+    send_protocol(w, net_atoms[WMPing], (long) w, 0);
+    c->ping_deadline = now() + PING_TIMEOUT;
+    // All deadlines are equally far off, so an armed timer expires earlier
+    if (!timers[TimerPing])
+        timers[TimerPing] = c->ping_deadline;
+}
+
+void focus(const Window w) {
+    XSetInputFocus(d, w, RevertToPointerRoot, CurrentTime);
+    timers[TimerRefocus] = 0;
+    if (active == w)
         return;
+    active = w;
+    root_set(RootActiveWindow, &active, 1);
+}
+
+Info get_info(const Client *c) {
+    return (Info) {c->server, c->extents, c->fixed, c->transient, c->type,
+        c->protocols, c->counter, c->bypass};
+}
+
+// Send a WM_PROTOCOLS ClientMessage, data beyond the timestamp is protocol-
+// specific
+void send_protocol(const Window w, const Atom protocol, const long data2,
+        const long data3) {
     XSendEvent(d, w, False, NoEventMask, (XEvent *) &(XClientMessageEvent) {
         .type = ClientMessage,
         .window = w,
@@ -304,28 +1519,147 @@ void delete(const Window w) {
         .format = 32,
         .data.l[0] = (long) protocol,
         .data.l[1] = CurrentTime,
+        .data.l[2] = data2,
+        .data.l[3] = data3,
     });
 }
 
-void focus(const Window w) {
-    XSetInputFocus(d, w, RevertToPointerRoot, CurrentTime);
-    XChangeProperty(d, r, net_atoms[ActiveWindow], XA_WINDOW,
-        32, PropModeReplace, (unsigned char *) &w, 1);
+// Only clients below head get a synchronous grab for click-to-raise, so
+// clicks into head reach it without a detour through xswm
+void grab(const Window w, const Bool on) {
+    if (on)
+        XGrabButton(d, AnyButton, AnyModifier, w, True, ButtonPressMask,
+            GrabModeSync, GrabModeSync, None, None);
+    else XUngrabButton(d, AnyButton, AnyModifier, w);
+}
+
+void manage(const Window w, const Info *info) {
+    // Initialize client and add to linked-list
+    if (head)
+        grab(head->w, True);
+    const Geometry *geometry = &info->geometry;
+    Client *c = client_alloc();
+    memcpy(c, &(Client) {
+        .w = w,
+        .fixed = info->fixed,
+        .transient = info->transient,
+        .type = info->type,
+        .width_request = geometry->width,
+        .height_request = geometry->height,
+        .border_width_request = BORDER_WIDTH,
+        .x = geometry->x, .y = geometry->y,
+        .width = geometry->width, .height = geometry->height,
+        .server = *geometry,
+        .event = {.width = -1},
+        .extents = info->extents,
+        .protocols = info->protocols,
+        .counter = info->counter,
+        .alarm = None,
+        .bypass = info->bypass,
+    }, sizeof(Client));
+    index_insert(&windows_index, c);
+    attach(c);
+    clients_n++;
+    // Update ewmh-client-lists
+    if (clients_n > client_list_size) {
+        client_list_size = clients_n * 2;
+        client_list = realloc(client_list,
+            (size_t) client_list_size * sizeof(Window));
+        client_list_stacking = realloc(client_list_stacking,
+            (size_t) client_list_size * sizeof(Window));
+    }
+    client_list[clients_n - 1] = w;
+    client_list_stacking[clients_n - 1] = w;
+    root_set(RootClientList, client_list, clients_n);
+    root_set(RootClientListStacking, client_list_stacking, clients_n);
+    // Configure, skipping what is already set
+    if (!c->extents) {
+        XChangeProperty(d, w, net_atoms[FrameExtents], XA_CARDINAL, 32,
+            PropModeReplace, (unsigned char *) (long []) {0, 0, 0, 0}, 4);
+        c->extents = True;
+    }
+    XChangeProperty(d, w, net_atoms[WMDesktop], XA_CARDINAL, 32,
+        PropModeReplace, (unsigned char *) (int []) {0}, 1);
+    XSelectInput(d, w, FocusChangeMask | PropertyChangeMask);
+    update_sync(c);
+    if (c->server.border_width != BORDER_WIDTH) {
+        XSetWindowBorderWidth(d, w, BORDER_WIDTH);
+        c->server.border_width = BORDER_WIDTH;
+    }
+    resize(c);
+    // Map
+    XChangeProperty(d, w, wm_atoms[State], wm_atoms[State], 32,
+        PropModeReplace, (unsigned char *) (long []) {NormalState, None}, 2);
+    XMapWindow(d, w);
+    update_visible();
+    focus(w);
 }
 
 void pop(const Window w) {
     Client *c = get_client(w);
     if (!c || head == c)
         return;
-    get_parent(c)->next = c->next;
-    c->next = head;
-    head = c;
+    grab(head->w, True);
+    grab(w, False);
+    detach(c);
+    attach(c);
+    update_visible();
     focus(w);
     XRaiseWindow(d, w);
-    update_client_list_stacking();
+    raise_stacking(w);
+}
+
+// Send the queries for the given parts of info at once, the replies are
+// waited for by collect()
+void query(const Window w, const int parts, Query *q) {
+    if (parts & InfoGeometry)
+        q->geometry = xcb_get_geometry(xc, (xcb_drawable_t) w);
+    if (parts & InfoHints)
+        q->hints = get_property(w, XA_WM_NORMAL_HINTS, XA_WM_SIZE_HINTS, 18);
+    if (parts & InfoTransient)
+        q->transient = get_property(w, XA_WM_TRANSIENT_FOR, XA_WINDOW, 1);
+    if (parts & InfoType)
+        q->type = get_property(w, net_atoms[WMWindowType], XA_ATOM, 1);
+    if (parts & InfoProtocols) {
+        q->protocols = get_property(w, wm_atoms[Protocols], XA_ATOM, 16);
+        q->counter = get_property(w, net_atoms[WMSyncRequestCounter],
+            XA_CARDINAL, 1);
+    }
+    if (parts & InfoBypass)
+        q->bypass = get_property(w, net_atoms[WMBypassCompositor],
+            XA_CARDINAL, 1);
+}
+
+void raise_stacking(const Window w) {
+    // Raised windows are usually close to the top
+    int i;
+    for (i = clients_n - 1; i > 0 && client_list_stacking[i] != w; i--);
+    memmove(&client_list_stacking[i], &client_list_stacking[i + 1],
+        (size_t) (clients_n - 1 - i) * sizeof(Window));
+    client_list_stacking[clients_n - 1] = w;
+    root_set(RootClientListStacking, client_list_stacking, clients_n);
+}
+
+// Called after clients_n was decremented like update_client_list()
+void remove_stacking(const Window w) {
+    int i;
+    for (i = clients_n; i > 0 && client_list_stacking[i] != w; i--);
+    memmove(&client_list_stacking[i], &client_list_stacking[i + 1],
+        (size_t) (clients_n - i) * sizeof(Window));
+    root_set(RootClientListStacking, client_list_stacking, clients_n);
+}
+
+// Run the focus-correction deferred by focus_in()
+void refocus(void) {
+    if (head)
+        focus(head->w);
 }
 
 void resize(Client *c) {
+    if (c->dirty) {
+        c->dirty = False;
+        dirty_n--;
+    }
     c->x = c->y = -BORDER_WIDTH, c->width = sw, c->height = sh;
     if (is_floating(c)) {
         // Center if smaller than screen
@@ -340,10 +1674,118 @@ void resize(Client *c) {
             c->height = c->height_request;
         }
     }
-    XMoveResizeWindow(d, c->w, c->x, c->y, (unsigned int) c->width,
-        (unsigned int) c->height);
+    Geometry *server = &c->server;
+    if (server->x != c->x || server->y != c->y
+            || server->width != c->width || server->height != c->height) {
+        // Only one resize at a time for clients which acknowledge them
+        if (is_synced(c) && c->sync_deadline) {
+            c->sync_pending = True;
+            return;
+        }
+        if (is_synced(c))
+            sync_request(c);
+        XMoveResizeWindow(d, c->w, c->x, c->y, (unsigned int) c->width,
+            (unsigned int) c->height);
+        *server = (Geometry) {c->x, c->y, c->width, c->height, BORDER_WIDTH};
+    }
     send_configure_event(c);
-    XSync(d, False);
+}
+
+// Adopt the existing windows, returns whether the clients of a previous
+// process were restored
+Bool scan(void) {
+    // Grab the server so no window changes between the queries and adopting
+    // it, the replies arrive on the same connection the grab is held by
+    XGrabServer(d);
+    const xcb_query_tree_cookie_t tree_cookie =
+        xcb_query_tree(xc, (xcb_window_t) r);
+    // Deleted with the request so the state is restored only once
+    const xcb_get_property_cookie_t state_cookie = xcb_get_property(xc, 1,
+        (xcb_window_t) r, (xcb_atom_t) XA_WM_RESTART, XCB_ATOM_CARDINAL, 0,
+        UINT32_MAX);
+    xcb_query_tree_reply_t *tree =
+        AUDIT_REPLY(xcb_query_tree_reply(xc, tree_cookie, NULL),
+            tree_cookie);
+    xcb_get_property_reply_t *state =
+        AUDIT_REPLY(xcb_get_property_reply(xc, state_cookie, NULL),
+            state_cookie);
+    const uint32_t *records = NULL;
+    int records_n = 0;
+    if (state && state->format == 32) {
+        const uint32_t *value = xcb_get_property_value(state);
+        const int n = xcb_get_property_value_length(state) / 4;
+        if (n >= 3 && value[0] == Record_Version) {
+            autostart_pid = (pid_t) value[1];
+            autostart_status = (int32_t) value[2];
+            records = value + 3;
+            records_n = (n - 3) / Record_N;
+        }
+    }
+    if (!tree) {
+        XUngrabServer(d);
+        free(state);
+        return False;
+    }
+    const int windows_n = xcb_query_tree_children_length(tree);
+    const xcb_window_t *windows = xcb_query_tree_children(tree);
+    // Send the queries for all windows before waiting for any reply, restored
+    // windows are only checked for still being mapped
+    typedef struct {
+        xcb_get_window_attributes_cookie_t attributes;
+        xcb_get_property_cookie_t state;
+        Query q;
+        Info info;
+        int record; // Index in records or -1
+        Bool manage;
+    } Scan;
+    Scan *scans = malloc((size_t) windows_n * sizeof(Scan));
+    for (int i = 0; i < windows_n; i++) {
+        Scan *scan = &scans[i];
+        scan->record = -1;
+        for (int j = 0; j < records_n && scan->record < 0; j++)
+            if (records[j * Record_N] == windows[i])
+                scan->record = j;
+        scan->attributes = xcb_get_window_attributes(xc, windows[i]);
+        if (scan->record >= 0)
+            continue;
+        scan->state = get_property(windows[i], wm_atoms[State],
+            wm_atoms[State], 2);
+        query(windows[i], InfoAll, &scan->q);
+    }
+    for (int i = 0; i < windows_n; i++) {
+        Scan *scan = &scans[i];
+        xcb_get_window_attributes_reply_t *attributes =
+            AUDIT_REPLY(xcb_get_window_attributes_reply(xc, scan->attributes,
+                NULL), scan->attributes);
+        int wm_state = WithdrawnState;
+        if (scan->record >= 0)
+            scan->info = restore(&records[scan->record * Record_N]);
+        else {
+            wm_state = get_state(scan->state);
+            collect(&scan->q, InfoAll, &scan->info);
+        }
+        scan->manage = attributes && !attributes->override_redirect
+            && (attributes->map_state == XCB_MAP_STATE_VIEWABLE
+                || wm_state == IconicState);
+        free(attributes);
+    }
+    // Adopt restored windows in their stacking-order first, then the others
+    // with non-transient windows before transient ones
+    for (int j = 0; j < records_n; j++)
+        for (int i = 0; i < windows_n; i++)
+            if (scans[i].record == j && scans[i].manage)
+                manage(windows[i], &scans[i].info);
+    for (int transient = 0; transient < 2; transient++)
+        for (int i = 0; i < windows_n; i++)
+            if (scans[i].manage && scans[i].record < 0
+                    && scans[i].info.transient == transient
+                    && !get_client(windows[i]))
+                manage(windows[i], &scans[i].info);
+    XUngrabServer(d);
+    free(scans);
+    free(tree);
+    free(state);
+    return records ? True : False;
 }
 
 void send_configure_event(Client *c) {
@@ -354,6 +1796,12 @@ void send_configure_event(Client *c) {
         x = x - BORDER_WIDTH + border_width;
         y = y - BORDER_WIDTH + border_width;
     }
+    c->border_width_request = BORDER_WIDTH;
+    // The client already knows about this geometry
+    const Geometry event = {x, y, c->width, c->height, border_width};
+    if (!memcmp(&c->event, &event, sizeof(Geometry)))
+        return;
+    c->event = event;
     const Window w = c->w;
     XSendEvent(d, w, False, StructureNotifyMask, (XEvent *) &(XConfigureEvent) {
         .type = ConfigureNotify,
@@ -368,89 +1816,426 @@ void send_configure_event(Client *c) {
         .above = None,
         .override_redirect = False,
     });
-    c->border_width_request = BORDER_WIDTH;
 }
 
+// Set or remove the _NET_WM_BYPASS_COMPOSITOR of xswm, a value set by the
+// client itself is never touched. The serial tells own changes apart in
+// property_notify().
+void set_bypass(Client *c, const Bool on) {
+    if (on && !c->bypass && !c->bypassed)
+        XChangeProperty(d, c->w, net_atoms[WMBypassCompositor], XA_CARDINAL,
+            32, PropModeReplace, (unsigned char *) (long []) {1}, 1);
+    else if (!on && c->bypassed)
+        XDeleteProperty(d, c->w, net_atoms[WMBypassCompositor]);
+    else
+        return;
+    c->bypassed = on;
+    c->bypass_serial = NextRequest(d) - 1;
+}
+
+// Stop managing c, destroyed windows only need to be forgotten. Requests for
+// windows destroyed in the meantime fail with BadWindow which xerror()
+// ignores, so no server-grab is needed.
+void unmanage(Client *c, const Bool destroyed) {
+    const Window w = c->w;
+    if (c->alarm) {
+        index_remove(&alarms_index, c);
+        XSyncDestroyAlarm(d, c->alarm);
+    }
+    if (!destroyed) {
+        cache_store(c);
+        grab(w, False);
+        XDeleteProperty(d, w, net_atoms[WMDesktop]);
+        XDeleteProperty(d, w, net_atoms[WMState]);
+        set_bypass(c, False);
+        XChangeProperty(d, w, wm_atoms[State], wm_atoms[State], 32,
+            PropModeReplace, (unsigned char *) (long []) {WithdrawnState, None},
+            2);
+    }
+    // Update list
+    const Bool was_head = c == head;
+    if (c == top)
+        top = NULL;
+    detach(c);
+    if (!head) {
+        active = None;
+        root_set(RootActiveWindow, &active, 0);
+        timers[TimerRefocus] = 0;
+    } else {
+        // Clients below c might be exposed now
+        update_visible();
+        if (was_head) {
+            grab(head->w, False);
+            focus(head->w);
+        }
+    }
+    if (c->dirty)
+        dirty_n--;
+    index_remove(&windows_index, c);
+    client_free(c);
+    clients_n--;
+    update_client_list(w);
+    remove_stacking(w);
+}
+
+void update_state(const Client *c) {
+    XChangeProperty(d, c->w, wm_atoms[State], wm_atoms[State], 32,
+        PropModeReplace, (unsigned char *) (long []) {c->hidden ? IconicState
+        : NormalState, None}, 2);
+    XChangeProperty(d, c->w, net_atoms[WMState], XA_ATOM, 32,
+        PropModeReplace, (unsigned char *) &net_atoms[WMStateHidden],
+        c->hidden ? 1 : 0);
+}
+
+// Clients are visible from head down to the first maximized client. Visible
+// ones are resized if out-of-date and shown, covered ones are hidden. The
+// covered clients which were visible before directly follow the visible
+// ones, so the walk stops at the first client which is already hidden.
+void update_visible(void) {
+    Client *old_top = top;
+    top = BYPASS_COMPOSITOR && head && !is_floating(head) ? head : NULL;
+    if (top != old_top && old_top)
+        set_bypass(old_top, False);
+    if (top != old_top && top)
+        set_bypass(top, True);
+    Client *c = head;
+    for (; c; c = c->next) {
+        if (c->dirty)
+            resize(c);
+        if (c->hidden) {
+            c->hidden = False;
+            update_state(c);
+        }
+        if (!is_floating(c))
+            break;
+    }
+    if (!HIDE_COVERED || !c)
+        return;
+    for (c = c->next; c && !c->hidden; c = c->next) {
+        c->hidden = True;
+        update_state(c);
+    }
+}
+
+// Called after clients_n was decremented so client_list still holds w
 void update_client_list(const Window w) {
-    // Get _NET_CLIENT_LIST
-    unsigned long nitems;
-    unsigned char *prop = NULL;
-    if (XGetWindowProperty(d, r, net_atoms[ClientList], 0, ~0, False, XA_WINDOW,
-    &(Atom) {None}, &(int) {None}, &nitems, &(unsigned long) {None}, &prop)
-    != Success || !prop || !nitems)
+    int i;
+    for (i = 0; i < clients_n && client_list[i] != w; i++);
+    memmove(&client_list[i], &client_list[i + 1],
+        (size_t) (clients_n - i) * sizeof(Window));
+    root_set(RootClientList, client_list, clients_n);
+}
+
+// (Re-)create the alarm of c for the current counter
+void update_sync(Client *c) {
+    if (c->alarm) {
+        index_remove(&alarms_index, c);
+        XSyncDestroyAlarm(d, c->alarm);
+    }
+    c->alarm = None;
+    c->sync_deadline = 0;
+    if (!is_synced(c)) {
+        if (c->sync_pending)
+            sync_done(c);
         return;
-    Window *client_list = (Window *) prop;
-    // Get window-index
-    unsigned long i;
-    for (i = 0; i < nitems && client_list[i] != w; i++);
-    // Remove w from _NET_CLIENT_LIST
-    if (i < nitems) {
-        memmove(&client_list[i], &client_list[i + 1], (--nitems - i) * sizeof(Window));
-        XChangeProperty(d, r, net_atoms[ClientList], XA_WINDOW, 32,
-            PropModeReplace, (unsigned char *) client_list, (int) nitems);
     }
-    XFree(prop);
+    XSyncAlarmAttributes attributes = {
+        .trigger = {
+            .counter = c->counter,
+            .value_type = XSyncAbsolute,
+            .test_type = XSyncPositiveComparison,
+        },
+        .events = True,
+    };
+    XSyncIntsToValue(&attributes.trigger.wait_value,
+        (unsigned int) c->sync_value, (int) (c->sync_value >> 32));
+    XSyncIntToValue(&attributes.delta, 0);
+    c->alarm = XSyncCreateAlarm(d, XSyncCACounter | XSyncCAValueType
+        | XSyncCAValue | XSyncCATestType | XSyncCADelta | XSyncCAEvents,
+        &attributes);
+    if (c->alarm)
+        index_insert(&alarms_index, c);
+    if (c->sync_pending)
+        sync_done(c);
+}
+
+// Derive the root-properties which depend on the screen-size
+void update_geometry(void) {
+    desktop_geometry[0] = sw, desktop_geometry[1] = sh;
+    workarea[0] = workarea[1] = 0, workarea[2] = sw, workarea[3] = sh;
+    root_set(RootDesktopGeometry, desktop_geometry, 2);
+    root_set(RootWorkarea, workarea, 4);
+}
+
+// The counter reached the value of the last sync_request()
+void alarm_notify(const XSyncAlarmNotifyEvent *e) {
+    Client *c = index_get(&alarms_index, e->alarm);
+    if (!c || !c->sync_deadline)
+        return;
+    // Skip notifications triggered before the last request
+    const unsigned long value =
+        (unsigned long) (unsigned int) XSyncValueHigh32(e->counter_value) << 32
+        | XSyncValueLow32(e->counter_value);
+    if (value >= c->sync_value)
+        sync_done(c);
+}
+
+Bool is_synced(const Client *c) {
+    return sync_event && c->counter && c->protocols & ProtocolSync;
+}
+
+// Stop waiting for the acknowledgment and run the resize deferred meanwhile
+void sync_done(Client *c) {
+    c->sync_deadline = 0;
+    if (!c->sync_pending)
+        return;
+    c->sync_pending = False;
+    resize(c);
+}
+
+// Ask c to set its counter to the next value once it handled the following
+// configure, see _NET_WM_SYNC_REQUEST
+void sync_request(Client *c) {
+    c->sync_value++;
+    XSyncAlarmAttributes attributes;
+    XSyncIntsToValue(&attributes.trigger.wait_value,
+        (unsigned int) c->sync_value, (int) (c->sync_value >> 32));
+    XSyncChangeAlarm(d, c->alarm, XSyncCAValue, &attributes);
+    send_protocol(c->w, net_atoms[WMSyncRequest],
+        (long) (c->sync_value & 0xffffffff), (long) (c->sync_value >> 32));
+    c->sync_deadline = now() + SYNC_TIMEOUT;
+    // All deadlines are equally far off, so an armed timer expires earlier
+    if (!timers[TimerSync])
+        timers[TimerSync] = c->sync_deadline;
+}
+
+// Give up on clients which did not acknowledge within SYNC_TIMEOUT
+void sync_timeout(void) {
+    const unsigned long time = now();
+    for (Client *c = head; c; c = c->next) {
+        if (c->sync_deadline && c->sync_deadline <= time)
+            sync_done(c);
+        if (c->sync_deadline && (!timers[TimerSync]
+                || c->sync_deadline < timers[TimerSync]))
+            timers[TimerSync] = c->sync_deadline;
+    }
 }
 
-void update_client_list_stacking(void) {
-    Window clients[clients_n];
-    int i = clients_n - 1;
-    for (Client *c = head; c; c = c->next)
-        clients[i--] = c->w;
-    XChangeProperty(d, r, net_atoms[ClientListStacking], XA_WINDOW, 32,
-        PropModeReplace, (unsigned char *) clients, clients_n);
+// Kill clients which did not answer the ping of delete() in time
+void ping_timeout(void) {
+    const unsigned long time = now();
+    for (Client *c = head; c; c = c->next) {
+        if (c->ping_deadline && c->ping_deadline <= time) {
+            c->ping_deadline = 0;
+            XKillClient(d, c->w);
+        }
+        if (c->ping_deadline && (!timers[TimerPing]
+                || c->ping_deadline < timers[TimerPing]))
+            timers[TimerPing] = c->ping_deadline;
+    }
 }
 
-Bool is_fixed(const Window w) {
-    XSizeHints hints;
-    if (!XGetWMNormalHints(d, w, &hints, &(long) {None}))
+// First counter of _NET_WM_SYNC_REQUEST_COUNTER or None
+XSyncCounter get_counter(const xcb_get_property_cookie_t cookie) {
+    xcb_get_property_reply_t *reply =
+        AUDIT_REPLY(xcb_get_property_reply(xc, cookie, NULL), cookie);
+    if (!reply)
+        return None;
+    XSyncCounter counter = None;
+    if (reply->format == 32 && xcb_get_property_value_length(reply) >= 4)
+        counter = *(uint32_t *) xcb_get_property_value(reply);
+    free(reply);
+    return counter;
+}
+
+int get_protocols(const xcb_get_property_cookie_t cookie) {
+    xcb_get_property_reply_t *reply =
+        AUDIT_REPLY(xcb_get_property_reply(xc, cookie, NULL), cookie);
+    if (!reply)
+        return 0;
+    const xcb_atom_t *atoms = xcb_get_property_value(reply);
+    const int atoms_n = reply->format == 32
+        ? xcb_get_property_value_length(reply) / 4 : 0;
+    int protocols = 0;
+    for (int i = 0; i < atoms_n; i++)
+        if (atoms[i] == net_atoms[WMSyncRequest])
+            protocols |= ProtocolSync;
+        else if (atoms[i] == wm_atoms[DeleteWindow])
+            protocols |= ProtocolDelete;
+        else if (atoms[i] == net_atoms[WMPing])
+            protocols |= ProtocolPing;
+    free(reply);
+    return protocols;
+}
+
+Bool is_fixed(const xcb_get_property_cookie_t cookie) {
+    xcb_get_property_reply_t *reply =
+        AUDIT_REPLY(xcb_get_property_reply(xc, cookie, NULL), cookie);
+    if (!reply)
         return False;
-    int min_width, min_height;
-    if (hints.flags & PMinSize) {
-        min_width = hints.min_width;
-        min_height = hints.min_height;
-    } else if (hints.flags & PBaseSize) {
-        min_width = hints.base_width;
-        min_height = hints.base_height;
-    } else
+    // Layout of WM_NORMAL_HINTS, see XSizeHints
+    const int32_t *hints = xcb_get_property_value(reply);
+    const int hints_n = reply->format == 32
+        ? xcb_get_property_value_length(reply) / 4 : 0;
+    Bool fixed = False;
+    if (hints_n >= 9) {
+        const long flags = (long) (uint32_t) hints[0];
+        int min_width = 0, min_height = 0;
+        Bool min = True;
+        if (flags & PMinSize) {
+            min_width = hints[5];
+            min_height = hints[6];
+        } else if (flags & PBaseSize && hints_n >= 17) {
+            min_width = hints[15];
+            min_height = hints[16];
+        } else
+            min = False;
+        fixed = min && (flags & PMaxSize)
+            && min_width  == hints[7]
+            && min_height == hints[8];
+    }
+    free(reply);
+    return fixed;
+}
+
+// Windows without a type are normal unless they are transient
+Bool is_normal(const Atom type, const Bool transient) {
+    return type ? type == net_atoms[WMWindowTypeNormal] : !transient;
+}
+
+// Whether the property has a value, e.g. WM_TRANSIENT_FOR
+Bool has_property(const xcb_get_property_cookie_t cookie) {
+    xcb_get_property_reply_t *reply =
+        AUDIT_REPLY(xcb_get_property_reply(xc, cookie, NULL), cookie);
+    if (!reply)
         return False;
-    if ((hints.flags & PMaxSize)
-            && min_width  == hints.max_width
-            && min_height == hints.max_height)
-        return True;
-    return False;
+    const Bool exists = xcb_get_property_value_length(reply) ? True : False;
+    free(reply);
+    return exists;
 }
 
-Bool is_normal(const Window w) {
-    unsigned char *prop = NULL;
-    if (XGetWindowProperty(d, w, net_atoms[WMWindowType], 0, 1, False,
-    XA_ATOM, &(Atom) {None}, &(int) {None}, &(unsigned long) {None},
-    &(unsigned long) {None}, &prop) != Success)
-        return True;
-    Bool normal = True;
-    if (prop) {
-        normal = *(Atom *) prop == net_atoms[WMWindowTypeNormal] ? True : False;
-        XFree(prop);
-    } else if (XGetTransientForHint(d, w, &(Window) {None}))
-        normal = False;
-    return normal;
+Bool is_floating(const Client *c) {
+    return c->fixed || !is_normal(c->type, c->transient);
 }
 
-Bool is_floating(const Client *c) { return c->fixed || !c->normal; }
+Atom get_type(const xcb_get_property_cookie_t cookie) {
+    xcb_get_property_reply_t *reply =
+        AUDIT_REPLY(xcb_get_property_reply(xc, cookie, NULL), cookie);
+    if (!reply)
+        return None;
+    Atom type = None;
+    if (xcb_get_property_value_length(reply) >= 4)
+        type = *(xcb_atom_t *) xcb_get_property_value(reply);
+    free(reply);
+    return type;
+}
 
-int get_state(const Window w) {
+int get_state(const xcb_get_property_cookie_t cookie) {
+    xcb_get_property_reply_t *reply =
+        AUDIT_REPLY(xcb_get_property_reply(xc, cookie, NULL), cookie);
+    if (!reply)
+        return -1;
     int state = -1;
-    unsigned char *prop = NULL;
-    unsigned long nitems;
-    if (XGetWindowProperty(d, w, wm_atoms[State], 0, 2, False, wm_atoms[State],
-    &(Atom) {None}, &(int) {None}, &nitems, &(unsigned long) {None},
-    (unsigned char **) &prop) != Success || !prop || !nitems)
-        return state;
-    state = *(int *) prop;
-    XFree(prop);
+    if (reply->format == 32 && xcb_get_property_value_length(reply) >= 4)
+        state = *(int32_t *) xcb_get_property_value(reply);
+    free(reply);
     return state;
 }
 
+xcb_get_property_cookie_t get_property(const Window w, const Atom property,
+        const Atom type, const uint32_t length) {
+    return xcb_get_property(xc, 0, (xcb_window_t) w, (xcb_atom_t) property,
+        (xcb_atom_t) type, 0, length);
+}
+
+// Spawn $XDG_CONFIG_HOME/xswm/autostart.sh without a shell or waiting for it
+void autostart(void) {
+    char path[4096];
+    const char *config = getenv("XDG_CONFIG_HOME"), *home = getenv("HOME");
+    if (config && *config)
+        snprintf(path, sizeof(path), "%s/xswm/autostart.sh", config);
+    else if (home)
+        snprintf(path, sizeof(path), "%s/.config/xswm/autostart.sh", home);
+    else
+        return;
+    if (access(path, X_OK))
+        return;
+    // Do not pass on the signals blocked for the signal-fd
+    posix_spawnattr_t attributes;
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigmask(&attributes, &signals);
+    posix_spawnattr_setflags(&attributes, (short) POSIX_SPAWN_SETSIGMASK);
+    char *argv[] = {path, NULL}, *sh_argv[] = {"sh", path, NULL};
+    int error = posix_spawn(&autostart_pid, path, NULL, &attributes, argv,
+        environ);
+    // Scripts without a #!-line run through /bin/sh like with system()
+    if (error == ENOEXEC)
+        error = posix_spawn(&autostart_pid, "/bin/sh", NULL, &attributes,
+            sh_argv, environ);
+    if (error)
+        autostart_pid = -1;
+    posix_spawnattr_destroy(&attributes);
+}
+
+// Collect exited children, only the exit-status of autostart is kept
+void reap(void) {
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        if (pid == autostart_pid)
+            autostart_status = WIFEXITED(status)
+                ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+#ifdef AUDIT
+// Account the time until audit_int() or audit_atom() to the running handler
+void audit_begin(void) { audit_start = now(); }
+
+int audit_int(const int result) {
+    audit_replies[audit_handler]++;
+    audit_round_trips[audit_handler]++;
+    audit_time[audit_handler] += now() - audit_start;
+    return result;
+}
+
+Atom audit_atom(const Atom result) {
+    audit_int(0);
+    return result;
+}
+
+// Takes the reply like xcb_wait_for_reply(), but only accounts a round-trip
+// if it has not arrived yet
+void * audit_reply(const unsigned int sequence) {
+    void *reply = NULL;
+    xcb_generic_error_t *error = NULL;
+    if (xcb_poll_for_reply(xc, sequence, &reply, &error))
+        audit_replies[audit_handler]++;
+    else {
+        audit_begin();
+        reply = xcb_wait_for_reply(xc, sequence, &error);
+        audit_int(0);
+    }
+    free(error);
+    return reply;
+}
+
+// Replies per handler, the round-trips among them and the time spent waiting
+size_t print_audit(char *text, const size_t size) {
+    size_t n = 0;
+    for (int i = 0; i < LASTEvent && n < size; i++) {
+        const char *name = i ? event_names[i] : "Other";
+        if (!name || !audit_replies[i])
+            continue;
+        n += (size_t) snprintf(text + n, size - n, "%-16s replies=%lu "
+            "round-trips=%lu waited=%luus\n", name, audit_replies[i],
+            audit_round_trips[i], audit_time[i]);
+    }
+    return n;
+}
+#endif
+
 int xerror(Display *dpy, XErrorEvent *e) { (void) dpy; (void) e; return 0; }
 
 int xerror_start(Display *dpy, XErrorEvent *e) {
@@ -463,29 +2248,102 @@ int xerror_start(Display *dpy, XErrorEvent *e) {
 }
 
 int main(const int argc, const char *argv[]) {
+    // Pipe commands through the control-socket without an X-connection
+    if (argc > 1 && !strcmp(argv[1], "-s"))
+        return control();
     if (!(d = XOpenDisplay(NULL))) {
         fprintf(stderr, "Error: Unable to open display.\n");
         return EXIT_FAILURE;
     }
-    // Remote-Control by setting the _XSWM_CMD property on the root-window
-    // and catching it with property_notify()
-    // Check property_notify() to see which commands are supported
+    // Remote-Control by sending a _XSWM_CMD ClientMessage with the opcode in
+    // data.l[0] to the root-window and catching it with client_message()
+    // Check commands[] to see which commands are supported
     r = XDefaultRootWindow(d);
-    XA_WM_CMD = XInternAtom(d, "_XSWM_CMD", False);
-    if (argc > 1) {
-        XChangeProperty(d, r, XA_WM_CMD, XA_STRING, 8,
-            PropModeReplace, (unsigned char *) argv[1], (int) strlen(argv[1]));
+    XA_WM_CMD = AUDIT_ATOM(XInternAtom(d, "_XSWM_CMD", False));
+    XA_WM_STATS = AUDIT_ATOM(XInternAtom(d, "_XSWM_STATS", False));
+    XA_WM_RESTART = AUDIT_ATOM(XInternAtom(d, "_XSWM_RESTART", False));
+    // Record the events of the main-loop to, or replay them from, a log
+    const Bool options = argc > 2
+        && (!strcmp(argv[1], "-r") || !strcmp(argv[1], "-p"));
+    const char *replay_path = options && argv[1][1] == 'p' ? argv[2] : NULL;
+    if (argc > 1 && !options) {
+        const int opcode = get_opcode(argv[1]);
+        if (opcode < 0) {
+            fprintf(stderr, "Error: Unknown command %s.\n", argv[1]);
+            XCloseDisplay(d);
+            return EXIT_FAILURE;
+        }
+        // Wait for the answer to "stats" and print it
+        const Bool reply = commands[opcode].run == stats;
+        if (reply)
+            XSelectInput(d, r, PropertyChangeMask);
+        XSendEvent(d, r, False, SubstructureRedirectMask | SubstructureNotifyMask,
+            (XEvent *) &(XClientMessageEvent) {
+                .type = ClientMessage,
+                .window = r,
+                .message_type = XA_WM_CMD,
+                .format = 32,
+                .data.l[0] = opcode,
+                .data.l[1] = argc > 2 ? strtol(argv[2], NULL, 0) : 0,
+            });
+        XEvent e;
+        XTextProperty p;
+        while (reply) {
+            // No xswm, or one without the stats-command, never answers
+            struct pollfd fd = {ConnectionNumber(d), POLLIN, 0};
+            if (!XPending(d) && poll(&fd, 1, STATS_TIMEOUT) <= 0) {
+                fprintf(stderr, "Error: No answer from xswm.\n");
+                XCloseDisplay(d);
+                return EXIT_FAILURE;
+            }
+            XNextEvent(d, &e);
+            if (e.type != PropertyNotify || e.xproperty.atom != XA_WM_STATS
+                    || e.xproperty.state != PropertyNewValue)
+                continue;
+            if (XGetTextProperty(d, r, &p, XA_WM_STATS) && p.value) {
+                fputs((char *) p.value, stdout);
+                XFree(p.value);
+            }
+            break;
+        }
         XCloseDisplay(d);
         return EXIT_SUCCESS;
     }
+    xc = XGetXCBConnection(d);
     // Check if another window-manager is already running
     XSetErrorHandler(xerror_start);
     XSelectInput(d, r, SubstructureRedirectMask);
-    XSync(d, False);
+    AUDIT_INT(XSync(d, False));
     XSetErrorHandler(xerror);
-    XSync(d, False);
-    // Handle signals
-    signal(SIGCHLD, SIG_IGN);
+    AUDIT_INT(XSync(d, False));
+    // Handle signals and timers through the main-loop
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    // Keep the connections to X out of spawned processes
+    fcntl(ConnectionNumber(d), F_SETFD, FD_CLOEXEC);
+    open_socket();
+    // Appended to, so a restart keeps recording into the same log
+    if (options && !replay_path) {
+        if (!(event_log = fopen(argv[2], "ab"))) {
+            fprintf(stderr, "Error: Unable to open %s.\n", argv[2]);
+            return EXIT_FAILURE;
+        }
+        fcntl(fileno(event_log), F_SETFD, FD_CLOEXEC);
+    }
+    // Throttle resizes with _NET_WM_SYNC_REQUEST if XSync is available
+    int sync_error, major, minor;
+    if (AUDIT_INT(XSyncQueryExtension(d, &sync_event, &sync_error))
+            && AUDIT_INT(XSyncInitialize(d, &major, &minor)))
+        sync_event += XSyncAlarmNotify;
+    else
+        sync_event = 0;
     // Variables
     const int s = XDefaultScreen(d);
     sh = XDisplayHeight(d, s);
@@ -495,7 +2353,7 @@ int main(const int argc, const char *argv[]) {
     wm_atom_names[Protocols] = "WM_PROTOCOLS";
     wm_atom_names[DeleteWindow] = "WM_DELETE_WINDOW";
     wm_atom_names[State] = "WM_STATE";
-    XInternAtoms(d, wm_atom_names, WM_N, False, wm_atoms);
+    AUDIT_INT(XInternAtoms(d, wm_atom_names, WM_N, False, wm_atoms));
     // EWMH-Atoms
     char *net_atom_names[Net_N];
     net_atom_names[ActiveWindow] = "_NET_ACTIVE_WINDOW";
@@ -516,17 +2374,27 @@ int main(const int argc, const char *argv[]) {
     net_atom_names[DesktopViewport] = "_NET_DESKTOP_VIEWPORT";
     net_atom_names[NumberOfDesktops] = "_NET_NUMBER_OF_DESKTOPS";
     net_atom_names[WMDesktop] = "_NET_WM_DESKTOP";
+    // Window-States
+    net_atom_names[WMState] = "_NET_WM_STATE";
+    net_atom_names[WMStateHidden] = "_NET_WM_STATE_HIDDEN";
+    // Compositing
+    net_atom_names[WMBypassCompositor] = "_NET_WM_BYPASS_COMPOSITOR";
+    // Sync-Requests
+    net_atom_names[WMSyncRequest] = "_NET_WM_SYNC_REQUEST";
+    net_atom_names[WMSyncRequestCounter] = "_NET_WM_SYNC_REQUEST_COUNTER";
+    // Pings
+    net_atom_names[WMPing] = "_NET_WM_PING";
     // Window-Types
     net_atom_names[WMWindowType] = "_NET_WM_WINDOW_TYPE";
     net_atom_names[WMWindowTypeDialog] = "_NET_WM_WINDOW_TYPE_DIALOG";
     net_atom_names[WMWindowTypeNormal] = "_NET_WM_WINDOW_TYPE_NORMAL";
     net_atom_names[WMWindowTypeSplash] = "_NET_WM_WINDOW_TYPE_SPLASH";
     net_atom_names[WMWindowTypeUtility] = "_NET_WM_WINDOW_TYPE_UTILITY";
-    XInternAtoms(d, net_atom_names, Net_N, False, net_atoms);
+    AUDIT_INT(XInternAtoms(d, net_atom_names, Net_N, False, net_atoms));
     // Indicate EWMH-Compliance
     const char wm_name[] = "xswm";
     const int wm_name_len = (int) strlen(wm_name);
-    const Atom utf8string = XInternAtom(d, "UTF8_STRING", False);
+    const Atom utf8string = AUDIT_ATOM(XInternAtom(d, "UTF8_STRING", False));
     const Window wm_check = XCreateSimpleWindow(d, r, 0, 0, 1, 1, 0, 0, 0);
     XChangeProperty(d, r, net_atoms[SupportingWMCheck], XA_WINDOW, 32,
         PropModeReplace, (unsigned char *) &wm_check, 1);
@@ -536,17 +2404,13 @@ int main(const int argc, const char *argv[]) {
         PropModeReplace, (unsigned char *) &wm_name, wm_name_len);
     XChangeProperty(d, r, net_atoms[Supported], XA_ATOM, 32,
         PropModeReplace, (unsigned char *) &net_atoms, Net_N);
-    // EWMH-Configuration
-    XChangeProperty(d, r, net_atoms[ActiveWindow], XA_WINDOW, 32,
-        PropModeReplace, None, 0);
-    XChangeProperty(d, r, net_atoms[ClientList], XA_WINDOW, 32,
-        PropModeReplace, None, 0);
-    XChangeProperty(d, r, net_atoms[ClientListStacking], XA_WINDOW, 32,
-        PropModeReplace, None, 0);
+    // EWMH-Configuration, dynamic properties are pushed by root_flush()
+    root_set(RootActiveWindow, &active, 0);
+    root_set(RootClientList, client_list, 0);
+    root_set(RootClientListStacking, client_list_stacking, 0);
+    update_geometry();
     XChangeProperty(d, r, net_atoms[CurrentDesktop], XA_CARDINAL, 32,
         PropModeReplace, (unsigned char *) (long []) {0}, 1);
-    XChangeProperty(d, r, net_atoms[DesktopGeometry], XA_CARDINAL, 32,
-        PropModeReplace, (unsigned char *) (long []) {sw, sh}, 2);
     XChangeProperty(d, r, net_atoms[DesktopNames], utf8string, 8,
         PropModeReplace, (unsigned char *) "", 1);
     XChangeProperty(d, r, net_atoms[DesktopViewport], XA_CARDINAL, 32,
@@ -555,59 +2419,83 @@ int main(const int argc, const char *argv[]) {
         PropModeReplace, (unsigned char *) (long []) {1}, 1);
     XChangeProperty(d, r, net_atoms[WMName], utf8string, 8,
         PropModeReplace, (unsigned char *) &wm_name, wm_name_len);
-    XChangeProperty(d, r, net_atoms[Workarea], XA_CARDINAL, 32,
-        PropModeReplace, (unsigned char *) (long []) {0, 0, sw, sh}, 4);
     // WM configuration
     XSelectInput(d, r, SubstructureRedirectMask | SubstructureNotifyMask
         | StructureNotifyMask | PropertyChangeMask);
     XDefineCursor(d, r, XCreateFontCursor(d, 68));
-    system("\"$XDG_CONFIG_HOME\"/xswm/autostart.sh &");
-    // Scan for windows which started before xswm
-    Window *windows = NULL;
-    unsigned int windows_n;
-    if (XQueryTree(d, r, &(Window) {None}, &(Window) {None}, &windows, &windows_n)
-    && windows) {
-        // Non-transient windows
-        for (unsigned int i = 0; i < windows_n; i++) {
-            XWindowAttributes wa;
-            const Window w = windows[i];
-            if (XGetWindowAttributes(d, w, &wa) && !wa.override_redirect
-            && !XGetTransientForHint(d, w, &(Window) {None})
-            && (wa.map_state == IsViewable || get_state(w) == IconicState))
-                map_request(w);
-        }
-        // Transient windows
-        for (unsigned int i = 0; i < windows_n; i++) {
-            XWindowAttributes wa;
-            const Window w = windows[i];
-            if (XGetWindowAttributes(d, w, &wa)
-            && XGetTransientForHint(d, w, &(Window) {None})
-            && (wa.map_state == IsViewable || get_state(w) == IconicState))
-                map_request(w);
+    // A restarted xswm already ran the autostart, replays never run it
+    const Bool restored = scan();
+    root_flush();
+    XFlush(d);
+    if (!restored && !replay_path)
+        autostart();
+    int status = EXIT_SUCCESS;
+    if (replay_path)
+        status = replay(replay_path);
+    // Main-Loop
+    while (running && !replay_path) {
+        // Batch requests of all queued events and flush once the queue is
+        // drained (XPending() would flush on every call)
+        if (!XEventsQueued(d, QueuedAfterReading)) {
+            if (event_log)
+                fflush(event_log);
+            serve();
+            continue;
         }
-        XFree(windows);
+        // Drain everything already readable into one batch
+        batch_time = now();
+        int batch_n = 0;
+        while (batch_n < Batch_N && XEventsQueued(d, QueuedAfterReading))
+            XNextEvent(d, &batch[batch_n++]);
+        if (event_log)
+            log_batch(batch, batch_n);
+        coalesce(batch, batch_n);
+        for (int i = 0; i < batch_n && running; i++)
+            dispatch(&batch[i]);
     }
-    // Main-Loop
-    XEvent e;
-    while (running) {
-        XNextEvent(d, &e);
-        switch (e.type) {
-            case ButtonPress: button_press(&e.xbutton); break;
-            case ClientMessage: client_message(&e.xclient); break;
-            case ConfigureNotify: configure_notify(&e.xconfigure); break;
-            case ConfigureRequest: configure_request(&e.xconfigurerequest); break;
-            case FocusIn: focus_in(&e.xfocus); break;
-            case MapRequest: map_request(e.xmaprequest.window); break;
-            case PropertyNotify: property_notify(&e.xproperty); break;
-            case UnmapNotify: unmap_notify(&e.xunmap); break;
+    // Clean-Up, leaving no values of xswm on the clients
+    for (Client *c = head; c; c = c->next) {
+        set_bypass(c, False);
+        if (c->hidden && !restarting) {
+            c->hidden = False;
+            update_state(c);
         }
     }
-    // Clean-Up
-    XDestroyWindow(d, wm_check);
-    while (head) {
-        Client *old_head = head;
-        head = head->next;
-        free(old_head);
+    if (restarting)
+        save_state();
+    for (int i = 0; i < Connections_N; i++)
+        if (connections[i].fd >= 0)
+            close(connections[i].fd);
+    if (listen_fd >= 0) {
+        struct sockaddr_un address;
+        close(listen_fd);
+        if (socket_path(&address))
+            unlink(address.sun_path);
     }
+    close(signal_fd);
+    close(timer_fd);
+    if (event_log)
+        fclose(event_log);
+#ifdef AUDIT
+    char audit[4096];
+    print_audit(audit, sizeof(audit));
+    fputs(audit, stderr);
+#endif
+    XDestroyWindow(d, wm_check);
+    pool_destroy();
+    free(client_list);
+    free(client_list_stacking);
+    free(cycle_windows);
+    for (int i = 0; i < Root_N; i++)
+        free(root_properties[i].pushed);
+    free(windows_index.table);
+    free(alarms_index.table);
     XCloseDisplay(d);
+    // Signals stay blocked and pending for the signalfd of the new process
+    if (restarting) {
+        execvp(argv[0], (char *const *) argv);
+        fprintf(stderr, "Error: Unable to restart %s.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    return status;
 }